@@ -3,11 +3,26 @@
  * CS 341 - Spring 2025
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && defined(__x86_64__)
+#include <sys/syscall.h>
+#define PERCPU_SUPPORTED 1  // rseq critical sections below are x86-64 only
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define STREAM_SUPPORTED 1  // AVX2 and AVX-512 copy kernels, picked at startup from cpuid
+#endif
 
 // used claude to help set up code, then prompted with ideas for free_list and full heap linked lists
 // to help implement O(1) free block look up and O(1) coalescing adjacent mem blocks
@@ -27,147 +42,540 @@
 #define M (K * 1024)
 #define G (M * 1024)
 
-#define SBRK_FAILURE ((void *)-1)
 #define MIN_SPLIT_SIZE 32
 #define BULK_ALLOC_SIZE (1024 * 1024)  // 4KB
 #define METADATA_SIZE sizeof(metadata_t)
-#define LARGE_SIZE (5 * M)
-#define PTR_SIZE (sizeof(void*))
-#define ALIGNMENT 3
-#define COALESCE_LAST 536870912
+#define ALIGNMENT 15  // every block is alignof(max_align_t) aligned
 #define MESSY_THRESHOLD 134217728
 #define MESSY_ALLOC_SIZE (METADATA_SIZE * 2) + MIN_SPLIT_SIZE * 4096
-#define G_ALLOC 1073872944
-#define FIRST_ALLOC_NOT_ENOUGH (8 * BULK_ALLOC_SIZE)
+
+// Segregated free lists: class 0 holds everything below 2^MIN_CLASS_SHIFT,
+// then every power of two is split into CLASS_STEPS quarter steps
+#define MIN_CLASS_SHIFT 5
+#define CLASS_STEPS 4
+#define NUM_SIZE_CLASSES (1 + (SIZE_BITS - MIN_CLASS_SHIFT) * CLASS_STEPS)
+#define BITMAP_WORDS ((NUM_SIZE_CLASSES + 63) / 64)
+#define FIT_SCAN_LIMIT 8  // blocks checked in the request's own class before moving up
+
+// Slabs: requests up to SLAB_MAX_SIZE are carved from page sized slabs, in
+// SLAB_QUANTUM steps and without a per-object header
+#define SLAB_SIZE 4096
+#define SLAB_MAX_SIZE 512
+#define SLAB_QUANTUM 16
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_QUANTUM)
+#define SLAB_REGION_SIZE (64ULL * G)  // address space reserved for slabs, only touched pages cost memory
+#define SLAB_REGION_MIN (256ULL * M)  // smallest reservation tried before slabs are given up
+#define SLAB_CLASS(size) (((size) - 1) / SLAB_QUANTUM)
+#define SLAB_DESC_CHUNK (64 * K)      // descriptors are carved from mappings of this size
+#define SLAB_RUN_SIZE HUGE_PAGE_SIZE  // arenas take slab pages from the region in runs of this size
+
+// Page map: three level radix tree keyed by address >> PAGE_SHIFT, covering 48 bit addresses.
+// A slab page's entry is its descriptor's address with the slab class in the low bits.
+#define PAGE_SHIFT 12
+#define PAGEMAP_BITS 12
+#define PAGEMAP_FANOUT (1 << PAGEMAP_BITS)
+#define PAGEMAP_CLASS_MASK ((uintptr_t)63)  // slab_t is 64 byte aligned
+#define PAGEMAP_INDEX(page, level) (((page) >> ((level) * PAGEMAP_BITS)) & (PAGEMAP_FANOUT - 1))
+
+// Per-thread cache of recently freed slab objects, one bin per slab class
+#define TCACHE_BIN_LIMIT 32   // objects kept per bin before frees go back to the slab
+
+// Regions (arena_create()) bump allocate through chunks taken from the heap and free them
+// all at once. malloc(), calloc() and realloc() use the region a thread put in scope.
+#define REGION_CHUNK_SIZE (64 * K)      // data bytes of a chunk unless arena_create() says otherwise
+#define REGION_CHUNK_MIN SLAB_MAX_SIZE  // a smaller chunk would be a slab object, whose page map entry hides region blocks
+#define REGION_HEADER_SIZE 16           // room for a block header that keeps the data 16 byte aligned
+
+// Optional per-CPU caches (ALLOC_PERCPU=1), used instead of the per-thread ones
+#define PERCPU_BIN_LIMIT 64  // blocks kept per size class on each CPU
+#define PERCPU_RETRIES 4     // restarted critical sections before taking the slow path
+#define RSEQ_SIG 0x53053053  // must precede every abort handler, same value glibc registers
+#define RSEQ_UNAVAILABLE ((rseq_area_t*)-1)
+
+// Arenas grow inside address ranges reserved up front with PROT_NONE. Pages are made
+// read/write with mprotect() in steps that double with the segment, so most growth
+// needs no system call, and the program break is left to whoever else uses it.
+#define MAX_ARENAS 64
+#define ARENAS_PER_CPU 4             // default arena count is this times the online CPUs
+#define ARENA_RESERVE_SIZE (64ULL * G)  // address space reserved per segment
+#define ARENA_RESERVE_MIN (64 * M)       // smallest reservation tried before growth fails
+#define ARENA_ALIGNMENT HUGE_PAGE_SIZE   // segments start on a huge page boundary
+#define COMMIT_MIN (1 * M)
+#define COMMIT_MAX (64 * M)
+#define MAIN_ARENA (&arenas[0])
+
+// Requests of at least ALLOC_MMAP_THRESHOLD bytes get their own mapping, unmapped on free.
+// Without the variable the threshold starts at MMAP_THRESHOLD and rises to the size of
+// freed mappings up to MMAP_THRESHOLD_MAX, so a loop reusing one large size stays on the heap.
+#define MMAP_THRESHOLD (1 * M)
+#define MMAP_THRESHOLD_MAX (32 * M)
+
+// Freed mappings are kept for reuse, up to ALLOC_LARGE_CACHE resident bytes in all and for
+// at most ALLOC_LARGE_CACHE_MS, so loops over one large size skip mmap, munmap and the page
+// faults. Only resident pages count, so a sparse mapping costs its few touched pages. They are
+// estimated from a window of LARGE_CACHE_SAMPLE_PAGES pages, one mincore() call per free.
+// A cached mapping serves requests that need within 1/2^LARGE_CACHE_SLACK_SHIFT of its size.
+#define LARGE_CACHE_BYTES (64 * M)
+#define LARGE_CACHE_MS 1000
+#define LARGE_CACHE_SLOTS 16
+#define LARGE_CACHE_SLACK_SHIFT 3
+#define LARGE_CACHE_SAMPLE_PAGES 16
+
+// realloc() copies and calloc() clears of at least ALLOC_STREAM_THRESHOLD bytes use
+// non-temporal stores, which bypass the caches so moving a huge block does not evict the
+// program's working set. ALLOC_COPY_KERNEL picks avx512, avx2 or libc; by default the widest
+// the CPU supports. Smaller sizes always go to libc's memmove() and memset().
+#define STREAM_THRESHOLD (8 * M)
+
+// Requests of at least ALLOC_POPULATE_THRESHOLD bytes are faulted in for writing before they
+// are returned, in one go instead of a page fault per page (0, the default, never does).
+// ALLOC_PRETOUCH bytes of the main arena are faulted in at startup and never given back.
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23  // Linux 5.14, older headers lack it
+#endif
+
+// With ALLOC_THP=1 the slab region and the arena segments are backed by transparent huge
+// pages. Memory is then committed and given back in whole huge pages only, so purging
+// never splits one, and empty slabs keep their pages.
+#define HUGE_PAGE_SIZE (2 * M)
+
+// Free blocks of at least ALLOC_TRIM_THRESHOLD bytes are dirty memory the OS can have back:
+// the top of an arena by decommitting it, whole pages inside other blocks through madvise.
+// Unless set, the threshold follows the mmap threshold at twice its value.
+#define TRIM_THRESHOLD (128 * K)
+
+// Dirty blocks are purged once they have been free for ALLOC_DIRTY_DECAY_MS. With a muzzy
+// phase (ALLOC_MUZZY_DECAY_MS) they are first given back lazily with MADV_FREE and only
+// released for good after that much longer. -1 never purges, 0 purges at once.
+#define DIRTY_DECAY_MS 10000
+#define MUZZY_DECAY_MS 0
+#define DECAY_CHECK_INTERVAL 64  // heap operations between clock reads while blocks wait
+#define DECAY_TICK_MS 100        // sleep of the purging thread started by ALLOC_BACKGROUND_THREAD=1
+
+// Header word: flags in bits 0-2 (sizes are multiples of 8), the size of the
+// data portion up to bit 47, the arena index in bits 48-55, extended flags from bit 56
+#define BLOCK_FREE 1  // Block is in a free list
+#define PREV_FREE 2   // Physically previous block is free, its size is in the btag just before this header
+#define MMAPPED 4     // Block has its own mapping and an mmap_header_t, it is not part of any heap
+#define ZEROED (1ULL << 56)  // Data is zero apart from the links and btag, see take_free_block()
+#define DIRTY (1ULL << 57)   // Free block waiting in the arena's dirty list, see decay_step()
+#define MUZZY (1ULL << 58)   // Same for the muzzy list, the pages were given back with MADV_FREE
+#define REGION_BLOCK (1ULL << 59)  // Block was bumped from a region in scope, it goes with the region
+#define SIZE_MASK 0x0000fffffffffff8ULL
+#define SIZE_BITS 48
+#define MAX_ALLOC_SIZE (SIZE_MASK - 2 * M)  // leaves room for headers and page rounding
+#define ARENA_SHIFT 48
+#define MIN_BLOCK_SIZE (2 * PTR_SIZE + BTAG_SIZE)  // a free block holds its links and btag
+#define BTAG_SIZE sizeof(uint64_t)
+#define PTR_SIZE (sizeof(void*))
 
 #define GET_BLOCK_PTR(ptr) (((metadata_t*)(ptr)) - 1)
-// #define GET_BTAG_PTR(block) ((unsigned int*)((char*)(block + 1) + (block)->size))
-// #define SET_BTAG(block) (*GET_BTAG_PTR(block) = (block)->size)
-#define ARE_ADJACENT(first, second) ((char*)(first + 1) + first->size == (char*)second)
+// Heap data sizes are 8 more than a multiple of 16. With the 8 byte header
+// every block then ends where the next one's 16 byte aligned data needs it.
+#define BLOCK_DATA_SIZE(size) ((((size) + METADATA_SIZE + ALIGNMENT) & ~(size_t)ALIGNMENT) - METADATA_SIZE)
+#define BLOCK_SIZE(block) ((block)->word & SIZE_MASK)
+#define SET_SIZE(block, size) ((block)->word = ((block)->word & ~SIZE_MASK) | (uint64_t)(size))
+#define MAKE_HEADER(size, arena_index) ((uint64_t)(size) | (uint64_t)(arena_index) << ARENA_SHIFT)
+#define LINKS(block) ((free_links_t*)((block) + 1))
+#define DECAY_LINKS(block) ((decay_links_t*)(LINKS(block) + 1))
+// Free blocks keep a copy of their size in the last bytes of their data portion
+#define GET_BTAG_PTR(block) ((uint64_t*)((char*)((block) + 1) + BLOCK_SIZE(block)) - 1)
+#define SET_BTAG(block) (*GET_BTAG_PTR(block) = BLOCK_SIZE(block))
+#define IS_FREE(block) ((block)->word & BLOCK_FREE)
+#define BLOCK_ARENA(block) (&arenas[((block)->word >> ARENA_SHIFT) & 0xff])
+#define IS_MMAPPED(block) ((block)->word & MMAPPED)
+#define IS_REGION_BLOCK(block) ((block)->word & REGION_BLOCK)
+#define GET_MMAP_HEADER(ptr) (((mmap_header_t*)(ptr)) - 1)
+#define IS_SLAB_OBJECT(ptr) (pagemap_get(ptr) != 0)
+#define GET_SLAB(ptr) PAGEMAP_SLAB(pagemap_get(ptr))
+#define PAGEMAP_SLAB(entry) ((slab_t*)((entry) & ~PAGEMAP_CLASS_MASK))
+#define PAGEMAP_CLASS(entry) ((unsigned int)((entry) & PAGEMAP_CLASS_MASK))
+#define NEXT_OBJECT(ptr) (*(void**)(ptr))  // free slab objects are linked through their first word
 
 typedef struct metadata {
-    struct metadata *prev;      // Previous block in free list
-    struct metadata *next;      // Next block in free list
-    unsigned int size;          // Size of the data portion (excluding metadata) // add prev size
-    int free;                  // Flag to indicate if block is free
+    uint64_t word;              // Size, arena and flags, see SIZE_MASK
 } metadata_t;
 
-// Global variables
-static metadata_t *free_list = NULL;     // Start of the free list
-static void *first_block = NULL;          // Start of the heap
-static metadata_t *last_metadata = NULL; // Pointer to the last metadata block in heap
-static int** contiguous_block = NULL;
-static unsigned int first_size = 0, idx = 0;
-static char first_free = 1;
-static char used_calloc = 0;
+// Only free blocks, and blocks queued for a remote free, carry links. They
+// live at the start of the data portion, see LINKS().
+typedef struct free_links {
+    struct metadata *prev;      // Previous block in size class free list
+    struct metadata *next;      // Next block in size class free list, or in a remote free queue
+} free_links_t;
+
+// Dirty and muzzy blocks are also kept in the order they were freed, through
+// a second set of links right after the first, see DECAY_LINKS()
+typedef struct decay_links {
+    struct metadata *prev;
+    struct metadata *next;
+    uint64_t since;             // When the block entered its list, in ms
+} decay_links_t;
+
+typedef struct decay_list {
+    struct metadata *head;      // Oldest block
+    struct metadata *tail;
+    size_t bytes;               // Purgeable bytes of the listed blocks
+} decay_list_t;
+
+// Header of a mmapped block, so the flags of any block can be read through GET_BLOCK_PTR()
+typedef struct mmap_header {
+    size_t map_size;            // Length of the whole mapping, header included
+    metadata_t block;           // MMAPPED and the requested size of the data portion
+} mmap_header_t;
+
+// Every chunk of a region starts with this. The chunks form a stack, the newest is bumped from.
+typedef struct region_chunk {
+    struct region_chunk *prev;  // Next older chunk
+    char *end;                  // End of the chunk's data
+} region_chunk_t;
+
+typedef struct region {
+    region_chunk_t *chunks;     // Newest chunk
+    char *next;                 // First unused byte of the newest chunk, NULL without chunks
+    size_t chunk_size;          // Data bytes of a standard chunk
+} region_t;
+
+// Slab states
+#define SLAB_FULL 0     // Every object handed out, on no list
+#define SLAB_PARTIAL 1  // On its arena's partial list for its class
+#define SLAB_EMPTY 2    // On its arena's empty list, can be reused for any class
+
+// Slab descriptor, kept out of line so the slab page holds nothing but objects.
+// A descriptor stays bound to its page for good, the page map leads from one to the other.
+typedef struct slab {
+    struct slab *prev;          // Neighbours in the partial list, next also links the empty list
+    struct slab *next;
+    void *free_objects;         // Freed objects, linked through NEXT_OBJECT()
+    char *base;                 // The slab page
+    unsigned short size;        // Object size
+    unsigned short cls;
+    unsigned short used;        // Objects handed out, including those sitting in caches
+    unsigned short carved;      // Objects ever handed out, the rest of the slab is untouched
+    unsigned short capacity;
+    unsigned short arena;       // Index of the arena the slab belongs to
+    unsigned char state;        // SLAB_FULL | SLAB_PARTIAL | SLAB_EMPTY
+} __attribute__((aligned(64))) slab_t;
+
+typedef struct pagemap_leaf {
+    uintptr_t entries[PAGEMAP_FANOUT];
+} pagemap_leaf_t;
+
+typedef struct pagemap_node {
+    pagemap_leaf_t *leaves[PAGEMAP_FANOUT];
+} pagemap_node_t;
+
+typedef struct arena {
+    pthread_mutex_t lock;
+    metadata_t *free_lists[NUM_SIZE_CLASSES];  // One free list per size class
+    uint64_t nonempty_classes[BITMAP_WORDS];   // Bit set when a class list has blocks
+    metadata_t *heap_top;                      // Fencepost ending the newest heap segment
+    char *segment_base;                        // Start of the newest segment's reservation
+    char *commit_end;                          // Read/write up to here, PROT_NONE beyond
+    char *reserve_end;
+    metadata_t *remote_frees;                  // Lock-free stack of blocks freed by other threads
+    slab_t *partial_slabs[SLAB_CLASSES];       // Slabs with free objects, per class
+    slab_t *empty_slabs;                       // Slabs with no object handed out
+    char *slab_run;                            // Unused part of the arena's current run of slab pages
+    size_t slab_run_left;
+    slab_t *spare_descs;                       // Unused part of the current descriptor chunk
+    size_t spare_desc_count;
+    void *remote_objects;                      // Lock-free stack of slab objects freed by other threads
+    decay_list_t dirty;                        // Free blocks whose pages are still resident
+    decay_list_t muzzy;                        // Free blocks whose pages the kernel may take
+    size_t purged_bytes;                       // Given back for good so far
+    unsigned int decay_ticks;                  // Heap operations since the last decay_step()
+    char *pinned_start;                        // Pages pretouched through ALLOC_PRETOUCH, never purged
+    char *pinned_end;
+    unsigned short index;
+} arena_t;
+
+typedef struct tcache {
+    void *bins[SLAB_CLASSES];                // Cached objects, linked through NEXT_OBJECT()
+    unsigned char counts[SLAB_CLASSES];
+    char registered;                         // Exit destructor installed for this thread
+    char disabled;                           // Thread is exiting, its cache was flushed
+    char own_rseq;                           // rseq area registered by us, unregistered at exit
+} tcache_t;
+
+// The critical sections index straight into these, see percpu_pop()
+typedef struct percpu_bin {
+    uint64_t count;
+    void *items[PERCPU_BIN_LIMIT];
+} percpu_bin_t;
+
+typedef struct percpu_cache {
+    percpu_bin_t bins[SLAB_CLASSES];
+} __attribute__((aligned(64))) percpu_cache_t;
 
-static char allocated = 0;
-static void *first_sbrk = NULL;
+// Kernel ABI of the per-thread rseq area (linux/rseq.h), only the original 32 bytes are used
+typedef struct rseq_area {
+    uint32_t cpu_id_start;
+    uint32_t cpu_id;         // CPU the thread runs on, kept current by the kernel
+    uint64_t rseq_cs;        // Descriptor of the critical section in progress
+    uint32_t flags;
+    uint32_t padding[3];
+} __attribute__((aligned(32))) rseq_area_t;
+
+// Set by glibc 2.35+ when it registered an rseq area for every thread
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+// Global variables, each arena's lists are protected by its own lock
+static arena_t arenas[MAX_ARENAS];
+static unsigned int num_arenas = 0;
+static unsigned int next_arena = 0;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static char mmap_threshold_fixed = 0;  // Set through ALLOC_MMAP_THRESHOLD, never adjusted
+static size_t trim_threshold = TRIM_THRESHOLD;
+static char trim_threshold_fixed = 0;  // Set through ALLOC_TRIM_THRESHOLD
+static long dirty_decay_ms = DIRTY_DECAY_MS;
+static long muzzy_decay_ms = MUZZY_DECAY_MS;
+static char background_thread_wanted = 0;  // Set through ALLOC_BACKGROUND_THREAD
+static char background_thread_started = 0;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static __thread tcache_t tcache __attribute__((tls_model("initial-exec")));
+static __thread arena_t *thread_arena __attribute__((tls_model("initial-exec")));
+static __thread region_t *current_region __attribute__((tls_model("initial-exec")));  // Set through arena_scope()
+static percpu_cache_t *percpu_caches = NULL;  // One per possible CPU, NULL unless ALLOC_PERCPU is set
+static unsigned int percpu_count = 0;
+static __thread rseq_area_t *thread_rseq __attribute__((tls_model("initial-exec")));
+static __thread rseq_area_t own_rseq_area __attribute__((tls_model("initial-exec")));
+static char *slab_base = NULL;           // Start of the region every slab is carved from
+static size_t slab_region_size = 0;      // 0 when no region could be reserved
+static size_t slab_region_used = 0;      // Bytes of the region handed to arenas so far
+static char thp_enabled = 0;             // Set through ALLOC_THP
+static pthread_mutex_t large_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static mmap_header_t *large_cache[LARGE_CACHE_SLOTS];  // NULL for a free slot
+static uint64_t large_cache_since[LARGE_CACHE_SLOTS];  // When each mapping was freed, in ms
+static size_t large_cache_resident[LARGE_CACHE_SLOTS]; // Resident bytes each is counted with
+static size_t large_cache_bytes = 0;     // Sum of the above, at least a page per cached mapping
+static unsigned int large_cache_samples = 0;  // Moves the window resident_estimate() looks at
+static size_t large_cache_budget = LARGE_CACHE_BYTES;
+static long large_cache_ms = LARGE_CACHE_MS;
+static size_t populate_threshold = 0;    // Set through ALLOC_POPULATE_THRESHOLD
+static size_t pretouch_size = 0;         // Set through ALLOC_PRETOUCH
+static char populate_advice_works = 1;   // Cleared when the kernel rejects MADV_POPULATE_WRITE
+static size_t stream_threshold = STREAM_THRESHOLD;
+static void (*stream_copy)(char *dst, const char *src, size_t n) = NULL;  // NULL while libc does every copy
+static void (*stream_zero)(char *dst, size_t n) = NULL;
+static char mremap_enabled = 1;          // Cleared through ALLOC_MREMAP=0
+static char check_sized_frees = 0;       // Set through ALLOC_CHECK_SIZED
+static pagemap_node_t *pagemap[PAGEMAP_FANOUT];  // Nodes and leaves are mapped on first use
 
 // Forward declarations with original size_t signatures
-void *find_free_block(size_t size);
-void *request_space(size_t size);
-void split_block(metadata_t *block, size_t size);
-void insert_free_block(metadata_t *block);
-void remove_free_block(metadata_t *block);
-void convert_first_block_to_metadata(int x);
+void *find_free_block(arena_t *arena, size_t size);
+void *request_space(arena_t *arena, size_t size);
+void split_block(arena_t *arena, metadata_t *block, size_t size);
+metadata_t *insert_free_block(arena_t *arena, metadata_t *block);
+int malloc_trim(size_t pad);
+void *memalign(size_t alignment, size_t size);
+void *pvalloc(size_t size);
+size_t malloc_usable_size(void *ptr);
+size_t malloc_good_size(size_t size);
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+static void sized_free(void *ptr, size_t size, size_t alignment);
+static void check_sized_free(void *ptr, size_t size, size_t alignment, size_t rounded);
+size_t malloc_batch(size_t size, size_t n, void **ptrs);
+void free_batch(size_t n, void **ptrs);
+static size_t heap_alloc_batch(arena_t *arena, size_t size, size_t n, void **ptrs);
+region_t *arena_create(size_t chunk_size);
+void *arena_alloc(region_t *region, size_t size);
+void *arena_mark(region_t *region);
+void arena_release_to_mark(region_t *region, void *mark);
+void arena_reset(region_t *region);
+void arena_destroy(region_t *region);
+region_t *arena_scope(region_t *region);
+static void *region_bump(region_t *region, size_t size);
+static void *region_malloc(region_t *region, size_t size, int zero);
+static size_t usable_size(void *ptr);
+void remove_free_block(arena_t *arena, metadata_t *block);
 metadata_t *get_next_block(metadata_t *block);
 metadata_t *get_prev_block(metadata_t *block);
+static unsigned int size_class(size_t size);
+static int next_nonempty_class(arena_t *arena, unsigned int cls);
+static void *take_free_block(arena_t *arena, metadata_t *block, size_t size);
+static void merge_zeroed(metadata_t *lower, metadata_t *upper);
+static void file_free_block(arena_t *arena, metadata_t *block);
+static void free_heap_block(arena_t *arena, metadata_t *block);
+static int trim_heap(arena_t *arena, size_t pad);
+static int purge_range(metadata_t *block, char **start, char **end);
+static void purge_block(arena_t *arena, metadata_t *block);
+static uint64_t now_ms(void);
+static void decay_push(decay_list_t *list, metadata_t *block, uint64_t now);
+static void decay_unlink(arena_t *arena, metadata_t *block);
+static void decay_step(arena_t *arena, uint64_t now);
+static void decay_maybe(arena_t *arena, int force);
+static void *background_purge(void *unused);
+static void start_background_thread(void);
+void malloc_decay_stats(size_t *dirty, size_t *muzzy, size_t *purged);
+int malloc_populate(void *ptr, size_t len);
+static int populate_range(void *start, size_t len);
+static void pretouch_heap(size_t size);
+static void *alloc_block(size_t size, int zero);
+static void *alloc_aligned(size_t alignment, size_t size);
+static void *small_alloc(arena_t *arena, unsigned int cls);
+static void *align_block(arena_t *arena, void *data, size_t alignment, size_t size);
+static void *mmap_alloc_aligned(size_t size, size_t alignment);
+static void *heap_alloc(arena_t *arena, size_t size, int *zeroed);
+static void *resize_block(arena_t *arena, metadata_t *block, size_t size);
+static void *mmap_alloc(size_t size, int zero);
+static void *mmap_resize(void *ptr, size_t size);
+static void mmap_free(void *ptr);
+static mmap_header_t *large_cache_take(size_t map_size);
+static int large_cache_put(mmap_header_t *header);
+static void large_cache_expire(uint64_t now);
+static size_t resident_estimate(mmap_header_t *header);
+static metadata_t *reserve_segment(arena_t *arena, size_t size);
+static int commit_to(arena_t *arena, char *end);
+static size_t release_unit(void);
+static void advise_huge(void *start, size_t length);
+static void copy_block(void *dst, const void *src, size_t n);
+static void zero_block(void *dst, size_t n);
+static void select_copy_kernel(const char *name);
+#ifdef STREAM_SUPPORTED
+static void stream_copy_avx2(char *dst, const char *src, size_t n);
+static void stream_zero_avx2(char *dst, size_t n);
+static void stream_copy_avx512(char *dst, const char *src, size_t n);
+static void stream_zero_avx512(char *dst, size_t n);
+#endif
+static void *slab_alloc(arena_t *arena, unsigned int cls);
+static size_t slab_alloc_batch(arena_t *arena, unsigned int cls, size_t n, void **ptrs);
+static slab_t *new_slab(arena_t *arena, unsigned int cls);
+static void slab_free(arena_t *arena, void *ptr);
+static slab_t *alloc_slab_desc(arena_t *arena);
+static uintptr_t pagemap_get(const void *ptr);
+static int pagemap_set(const void *ptr, uintptr_t entry);
+static void *pagemap_alloc_node(void **slot, size_t size);
+static void init_slabs(void);
+static void *tcache_pop(unsigned int cls);
+static int tcache_push(void *ptr, unsigned int cls);
+static void tcache_flush(void *unused);
+static void register_thread_exit(void);
+static void *cache_pop(unsigned int cls);
+static int cache_push(void *ptr, unsigned int cls);
+static void init_percpu(void);
+#ifdef PERCPU_SUPPORTED
+static rseq_area_t *get_rseq(void);
+static void *percpu_pop(rseq_area_t *rs, unsigned int cls);
+static int percpu_push(rseq_area_t *rs, unsigned int cls, void *ptr);
+#endif
+static void tcache_make_key(void);
+static void init_arenas(void);
+static arena_t *get_thread_arena(void);
+static void lock_arena(arena_t *arena);
+static void release_block(metadata_t *block);
+static void release_object(void *ptr);
+static void remote_free(arena_t *arena, metadata_t *block);
+static void remote_free_object(arena_t *arena, void *ptr);
+static void drain_remote_frees(arena_t *arena);
+static void alloc_init(void) __attribute__((constructor));
+static void fork_prepare(void);
+static void fork_release(void);
+static void fork_child(void);
 
 // Advanced Debugger
 // static int x = 1;
-// void get_free_list() {
-//     metadata_t* curr = free_list;
-//     while (curr) {
-//         fprintf(stderr, "Free Chunk %d: %d\n", x, curr->size);
-//         curr = curr->next;
+// void get_free_list(arena_t *arena) {
+//     for (int cls = next_nonempty_class(arena, 0); cls >= 0; cls = next_nonempty_class(arena, cls + 1)) {
+//         for (metadata_t* curr = arena->free_lists[cls]; curr; curr = LINKS(curr)->next) {
+//             fprintf(stderr, "Free Chunk %d (class %d): %llu\n", x, cls, BLOCK_SIZE(curr));
+//         }
 //     }
 //     x++;
 // }
 
 void *calloc(size_t num, size_t size) {
-    used_calloc = 1;
     if (num == 0 || size == 0) return NULL;
-    unsigned int total_size = (unsigned int)num * (unsigned int)size;
-    void *ptr = malloc(total_size);
-    if (ptr) memset(ptr, 0, total_size);
-    return ptr;
+    size_t total_size;
+    if (__builtin_mul_overflow(num, size, &total_size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (current_region) return region_malloc(current_region, total_size, 1);
+    return alloc_block(total_size, 1);
 }
 
-static int seen = 0;
 void *malloc(size_t size) {
+    if (current_region) return region_malloc(current_region, size, 0);
+    return alloc_block(size, 0);
+}
+
+// malloc() proper. With zero set the data is cleared, but only the parts that
+// did not come straight from the OS: fresh mmap memory is zero already.
+static void *alloc_block(size_t size, int zero) {
     // fprintf(stderr, "Size: %lu\n", size);
     if (size == 0) return NULL;
-    unsigned int u_size = (unsigned int)size;
-    u_size = (u_size + ALIGNMENT) & ~ALIGNMENT;
-    if (!first_size) return request_space(u_size);
-
-    if (first_free) {
-        if (first_size >= u_size) {
-            first_free = 0;
-            return first_block;
-        }
-        convert_first_block_to_metadata(0);
-        first_free = 0;
+    if (size > MAX_ALLOC_SIZE) {
+        errno = ENOMEM;
+        return NULL;
     }
+    // Slabs and mappings take whole 16 byte steps, heap blocks round on their own
+    size_t rounded = (size + ALIGNMENT) & ~(size_t)ALIGNMENT;
 
-
-    if (allocated && size == sizeof(int)) {
-        if (!idx) first_sbrk = sbrk(0);
-        // int x = M;
-        if (idx % M == 0) sbrk(M * sizeof(int));
-        contiguous_block[idx] = (int*)((char*)first_sbrk + idx * sizeof(int));
-        return contiguous_block[idx++];
+    // Small requests come from slabs, the heap only takes them when no slab can be had
+    arena_t *arena = get_thread_arena();
+    if (rounded <= SLAB_MAX_SIZE) {
+        void *object = small_alloc(arena, SLAB_CLASS(rounded));
+        if (object) {
+            if (zero) memset(object, 0, rounded);
+            return object;
+        }
     }
 
-    if (size == PTR_SIZE * LARGE_SIZE) {
-        allocated = 1;
-        contiguous_block = sbrk(0) + METADATA_SIZE;
+    if (rounded >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        return mmap_alloc(rounded, zero);
     }
-    
-    // Otherwise try to find a suitable existing block
-    void *block = find_free_block(u_size);
-    if (block) return block; // Split and everything
+    size = BLOCK_DATA_SIZE(size);
+    if (size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
 
-    if (!first_free && first_size > 1) {
-        if (!seen) {
-            convert_first_block_to_metadata(1);
-            seen = 1;
-        }
-        metadata_t *prev = last_metadata;
-        metadata_t *nblock = GET_BLOCK_PTR(request_space(FIRST_ALLOC_NOT_ENOUGH));
-        if (prev && ARE_ADJACENT(prev, nblock)) {
-            prev->size += METADATA_SIZE + nblock->size;
-            last_metadata = prev;
-            nblock = prev;
-        }
-        if (nblock->size >= u_size) {
-            remove_free_block(nblock);
-            if (nblock->size >= u_size + MIN_SPLIT_SIZE) {
-                split_block(nblock, u_size);
-            }
-            
-            return (void*)(nblock + 1);
-        }
+    int zeroed = 0;
+    lock_arena(arena);
+    void *block = heap_alloc(arena, size, &zeroed);
+    pthread_mutex_unlock(&arena->lock);
+    if (block && zero && !zeroed) zero_block(block, size);
+    return block;
+}
+
+// A slab object of class cls from the thread's cache or the arena, NULL when no slab can be had
+static void *small_alloc(arena_t *arena, unsigned int cls) {
+    void *object = cache_pop(cls);
+    if (!object) {
+        lock_arena(arena);
+        object = slab_alloc(arena, cls);
+        pthread_mutex_unlock(&arena->lock);
     }
-    
-    // If no suitable block found, request more memory
+    return object;
+}
+
+// Caller holds the arena lock. zeroed is set when the data is known to be zero.
+static void *heap_alloc(arena_t *arena, size_t size, int *zeroed) {
+    decay_maybe(arena, 0);
+
+    // Otherwise try to find a suitable existing block
+    void *block = find_free_block(arena, size);
+    int fresh = block && (GET_BLOCK_PTR(block)->word & ZEROED);
     if (!block) {
-        // For small allocations after the initial phase, request a larger chunk to reduce sbrk calls
-        if (u_size < BULK_ALLOC_SIZE) {
-            block = request_space(BULK_ALLOC_SIZE);
-            if (block) {
-                metadata_t *metadata = GET_BLOCK_PTR(block);
-                if (metadata->size > u_size) {
-                    split_block(metadata, u_size);
-                }
-            }
-        } else {
-            // For large requests, allocate exactly what's needed
-            block = request_space(u_size);
+        fresh = 1;
+        // If no suitable block found, request more memory
+        // For small allocations, request a larger chunk to reduce growth steps
+        block = request_space(arena, size < BULK_ALLOC_SIZE ? BULK_ALLOC_SIZE : size);
+        if (!block) return NULL;
+        metadata_t *metadata = GET_BLOCK_PTR(block);
+        if (BLOCK_SIZE(metadata) >= size + MIN_SPLIT_SIZE) {
+            split_block(arena, metadata, size);
         }
     }
-    
+
+    // Pages new to the heap or purged fault on first use, reused ones are resident
+    if (fresh && populate_threshold && size >= populate_threshold) populate_range(block, size);
+
+    // Allocated blocks never keep ZEROED, frees would trust it otherwise
+    metadata_t *metadata = GET_BLOCK_PTR(block);
+    *zeroed = (metadata->word & ZEROED) != 0;
+    metadata->word &= ~ZEROED;
     return block;
 }
 
@@ -175,342 +583,1995 @@ void free(void *ptr) {
     if (!ptr) {
         return;  // Ignore NULL pointer
     }
-    if (first_size > 1) {
-        first_free = 1;
+
+    // Slab objects have no header, the page map knows their class
+    uintptr_t entry = pagemap_get(ptr);
+    if (entry) {
+        if (cache_push(ptr, PAGEMAP_CLASS(entry))) return;
+        release_object(ptr);
         return;
     }
 
-    if (allocated == 1) {
-        idx -= 1;
-        allocated = 2;
-        return;
-    } 
-    else if (allocated == 2) {
-        if (idx-- % M == 0) sbrk((intptr_t)(-1 * (long)M * (long)sizeof(int))); // Remove memory
+    metadata_t *block = GET_BLOCK_PTR(ptr);
+    if (IS_MMAPPED(block)) {
+        mmap_free(ptr);
         return;
     }
+    // Region blocks are freed with their region
+    if (IS_FREE(block) || IS_REGION_BLOCK(block)) return;
+    release_block(block);
+}
 
-    metadata_t *block = GET_BLOCK_PTR(ptr);
-    if (block->free) return;
-    insert_free_block(block);
+// C23 sized deallocation. size is what the block was allocated with
+void free_sized(void *ptr, size_t size) {
+    sized_free(ptr, size, 0);
 }
 
-void *realloc(void *ptr, size_t size) {
-    if (!ptr) return malloc(size);
-    if (size == 0) {
-        free(ptr);
-        return NULL;
+void free_aligned_sized(void *ptr, size_t alignment, size_t size) {
+    sized_free(ptr, size, alignment);
+}
+
+// The size, rounded like the allocation was, gives a slab object's class,
+// and the slab region's bounds tell slab objects from other blocks. So a
+// slab object goes to its cache without reading the page map or any
+// header. Everything else takes the usual way through free().
+static void sized_free(void *ptr, size_t size, size_t alignment) {
+    if (!ptr) return;
+    size_t rounded = (size + ALIGNMENT) & ~(size_t)ALIGNMENT;
+    if (alignment > ALIGNMENT + 1) {
+        rounded = alignment <= SLAB_MAX_SIZE ? (rounded + alignment - 1) & ~(alignment - 1) : SIZE_MAX;
     }
+    if (check_sized_frees) check_sized_free(ptr, size, alignment, rounded);
 
-    size = (size + ALIGNMENT) & ~ALIGNMENT;
+    if (rounded - 1 < SLAB_MAX_SIZE && (uintptr_t)ptr - (uintptr_t)slab_base < slab_region_size) {
+        if (cache_push(ptr, SLAB_CLASS(rounded))) return;
+        release_object(ptr);
+        return;
+    }
+    free(ptr);
+}
 
-    if (ptr == first_block) {
-        if (first_size > 1 && first_free && size <= first_size) {
-            first_free = 0;
-            return first_block;
-        }
-        if (first_size > 1 && (!first_free || size != first_size)) {
-            convert_first_block_to_metadata(0);
-            if (size <= first_size) return ptr;
+// ALLOC_CHECK_SIZED=1: a size or alignment the block cannot have come from aborts
+static void check_sized_free(void *ptr, size_t size, size_t alignment, size_t rounded) {
+    uintptr_t entry = pagemap_get(ptr);
+    size_t usable = usable_size(ptr);
+    int bad = size > usable || (alignment && ((uintptr_t)ptr & (alignment - 1)));
+    if (entry && (rounded - 1 >= SLAB_MAX_SIZE || SLAB_CLASS(rounded) != PAGEMAP_CLASS(entry))) bad = 1;
+    if (!entry && !bad) {
+        // Too large a block for the size: a heap block keeps at most a tail too
+        // small to split off, a mapping its page rounding and the cache slack
+        metadata_t *block = GET_BLOCK_PTR(ptr);
+        size_t expected = (size + ALIGNMENT) & ~(size_t)ALIGNMENT;
+        if (IS_MMAPPED(block)) {
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t map_size = (expected + sizeof(mmap_header_t) + page - 1) & ~(page - 1);
+            bad = usable > map_size + (map_size >> LARGE_CACHE_SLACK_SHIFT);
+        } else if (IS_REGION_BLOCK(block)) {
+            bad = usable != expected;
+        } else {
+            expected = BLOCK_DATA_SIZE(size) < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : BLOCK_DATA_SIZE(size);
+            bad = usable - expected >= MIN_SPLIT_SIZE;
         }
     }
+    if (!bad) return;
+    // free_sized() passes no alignment, free_aligned_sized() always one
+    if (alignment) {
+        fprintf(stderr, "alloc: free_aligned_sized(%p, %zu, %zu) of a %zu byte block\n", ptr, alignment, size, usable);
+    } else {
+        fprintf(stderr, "alloc: free_sized(%p, %zu) of a %zu byte block\n", ptr, size, usable);
+    }
+    abort();
+}
 
-    metadata_t *block = GET_BLOCK_PTR(ptr);
+// Up to n blocks of size bytes into ptrs, returns how many. Small blocks
+// come from the cache and then from slabs, heap blocks are cut from one
+// region, each under a single lock. Mappings are made one by one.
+size_t malloc_batch(size_t size, size_t n, void **ptrs) {
+    if (size == 0 || n == 0) return 0;
+    if (size > MAX_ALLOC_SIZE) {
+        errno = ENOMEM;
+        return 0;
+    }
+    size_t rounded = (size + ALIGNMENT) & ~(size_t)ALIGNMENT;
 
-    // If current block size is sufficient
-    if (block->size >= size) {
-        if (block->size >= size + MIN_SPLIT_SIZE) {
-            split_block(block, size);
+    arena_t *arena = get_thread_arena();
+    size_t got = 0;
+    if (current_region) {
+        while (got < n && (ptrs[got] = region_malloc(current_region, size, 0))) got++;
+        return got;
+    }
+    if (rounded <= SLAB_MAX_SIZE) {
+        unsigned int cls = SLAB_CLASS(rounded);
+        while (got < n && (ptrs[got] = cache_pop(cls))) got++;
+        if (got < n) {
+            lock_arena(arena);
+            got += slab_alloc_batch(arena, cls, n - got, ptrs + got);
+            pthread_mutex_unlock(&arena->lock);
         }
-        // get_free_list();
-        return ptr;
+    } else if (rounded < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        lock_arena(arena);
+        got = heap_alloc_batch(arena, BLOCK_DATA_SIZE(size), n, ptrs);
+        pthread_mutex_unlock(&arena->lock);
     }
+    while (got < n && (ptrs[got] = alloc_block(size, 0))) got++;
+    return got;
+}
 
-    metadata_t *prev_block = get_prev_block(block);
-    metadata_t *next_block = get_next_block(block);
-    int prev_free = 0, next_free = 0;
-    size_t total_size = block->size;
-
-    // Check if previous block is free
-    if (prev_block && prev_block->free) {
-        prev_free = 1;
-        total_size += METADATA_SIZE + prev_block->size;
-    }
-
-    // Check if next block is free
-    if (next_block && next_block->free) {
-        next_free = 1;
-        total_size += METADATA_SIZE + next_block->size;
-    }
-
-    // Coalescing strategies
-    if (total_size >= size) {
-        if (prev_free && next_free) {
-            remove_free_block(prev_block);
-            remove_free_block(next_block);
-            prev_block->size = total_size;
-            prev_block->free = 0;
-            if (next_block == last_metadata) last_metadata = prev_block;
-            memmove(prev_block + 1, ptr, block->size);
-            if (total_size >= size + MIN_SPLIT_SIZE) {
-                split_block(prev_block, size);
-            }
-            return prev_block + 1;
-        } else if (prev_free) {
-            remove_free_block(prev_block);
-            prev_block->size += METADATA_SIZE + block->size;
-            prev_block->free = 0;
-            memmove(prev_block + 1, ptr, block->size);
-            if (prev_block->size >= size + MIN_SPLIT_SIZE) {
-                split_block(prev_block, size);
-            }
-            return prev_block + 1;
-        } else if (next_free) {
-            remove_free_block(next_block);
-            block->size += METADATA_SIZE + next_block->size;
-            if (next_block == last_metadata) last_metadata = block;
-            if (block->size >= size + MIN_SPLIT_SIZE) {
-                split_block(block, size);
+// Caller holds the arena lock. One free region for all n blocks, cut into
+// consecutive blocks with the last keeping the rest. 0 when there is none.
+static size_t heap_alloc_batch(arena_t *arena, size_t size, size_t n, void **ptrs) {
+    size_t stride = METADATA_SIZE + size;
+    if (n > MAX_ALLOC_SIZE / stride) return 0;
+    int zeroed;
+    void *data = heap_alloc(arena, n * stride - METADATA_SIZE, &zeroed);
+    if (!data) return 0;
+
+    metadata_t *block = GET_BLOCK_PTR(data);
+    size_t rest = BLOCK_SIZE(block);
+    for (size_t i = 0; i + 1 < n; i++) {
+        SET_SIZE(block, size);
+        ptrs[i] = block + 1;
+        rest -= stride;
+        block = get_next_block(block);
+        block->word = MAKE_HEADER(rest, arena->index);
+    }
+    ptrs[n - 1] = block + 1;
+    if (rest >= size + MIN_SPLIT_SIZE) split_block(arena, block, size);
+    return n;
+}
+
+// Frees n blocks, NULL entries are skipped. Slab objects go to the cache
+// while it takes them. Everything else of this thread's arena is freed
+// under one lock, which the cache is not pushed to while held: a thread's
+// first push may allocate.
+void free_batch(size_t n, void **ptrs) {
+    arena_t *own = get_thread_arena();
+    int locked = 0;
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+        if (!ptr) continue;
+        uintptr_t entry = pagemap_get(ptr);
+        if (entry) {
+            if (!locked && cache_push(ptr, PAGEMAP_CLASS(entry))) continue;
+            arena_t *arena = &arenas[PAGEMAP_SLAB(entry)->arena];
+            if (arena != own) {
+                remote_free_object(arena, ptr);
+                continue;
             }
-            return ptr;
+            if (!locked) lock_arena(own);
+            locked = 1;
+            slab_free(own, ptr);
+            continue;
+        }
+
+        metadata_t *block = GET_BLOCK_PTR(ptr);
+        if (IS_MMAPPED(block)) {
+            mmap_free(ptr);
+            continue;
+        }
+        if (IS_FREE(block) || IS_REGION_BLOCK(block)) continue;
+        if (BLOCK_ARENA(block) != own) {
+            remote_free(BLOCK_ARENA(block), block);
+            continue;
         }
-    } 
-    else if (last_metadata->free && size == COALESCE_LAST) {
-        unsigned int remaining = size - last_metadata->size;
-        void *new_ptr = sbrk(remaining);
-        if (new_ptr == SBRK_FAILURE) return NULL;
-        last_metadata->size = size;
-        new_ptr = (void*)(last_metadata + 1);
-        memcpy(new_ptr, ptr, block->size);
+        if (!locked) lock_arena(own);
+        locked = 1;
+        free_heap_block(own, block);
+    }
+    if (!locked) return;
+
+    int waiting = own->dirty.head || own->muzzy.head;
+    pthread_mutex_unlock(&own->lock);
+    if (waiting && background_thread_wanted && !background_thread_started) start_background_thread();
+}
+
+// A region hands out memory by bumping a pointer through chunks of the heap
+// and gives it back all at once, with arena_reset() or arena_release_to_mark().
+// chunk_size is the data size of a chunk, 0 for REGION_CHUNK_SIZE. A region
+// is used by one thread at a time.
+region_t *arena_create(size_t chunk_size) {
+    if (chunk_size > MAX_ALLOC_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (chunk_size == 0) chunk_size = REGION_CHUNK_SIZE;
+    if (chunk_size < REGION_CHUNK_MIN) chunk_size = REGION_CHUNK_MIN;
+    region_t *region = alloc_block(sizeof(region_t), 0);
+    if (!region) return NULL;
+    region->chunks = NULL;
+    region->next = NULL;
+    region->chunk_size = (chunk_size + ALIGNMENT) & ~(size_t)ALIGNMENT;
+    return region;
+}
+
+// 16 byte aligned like malloc(), and NULL for size 0 likewise
+void *arena_alloc(region_t *region, size_t size) {
+    if (size == 0) return NULL;
+    if (size > MAX_ALLOC_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return region_bump(region, (size + ALIGNMENT) & ~(size_t)ALIGNMENT);
+}
+
+// The region's fill level. Releasing to it frees what was allocated since,
+// including the memory of later marks.
+void *arena_mark(region_t *region) {
+    return region->next;
+}
+
+// Chunks newer than the one the mark points into go back to the heap, the
+// rest of that one is bumped from again
+void arena_release_to_mark(region_t *region, void *mark) {
+    uintptr_t at = (uintptr_t)mark;
+    region_chunk_t *chunk = region->chunks;
+    while (chunk && (at < (uintptr_t)(chunk + 1) || at > (uintptr_t)chunk->end)) {
+        region_chunk_t *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+    region->chunks = chunk;
+    region->next = chunk ? mark : NULL;
+}
+
+// Frees every chunk but the oldest, which the region starts over in, so a
+// region reset after each request does not go back to the heap for it. An
+// oversized oldest chunk is freed as well.
+void arena_reset(region_t *region) {
+    region_chunk_t *chunk = region->chunks;
+    while (chunk && chunk->prev) {
+        region_chunk_t *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+    if (chunk && (size_t)(chunk->end - (char*)(chunk + 1)) > region->chunk_size) {
+        free(chunk);
+        chunk = NULL;
+    }
+    region->chunks = chunk;
+    region->next = chunk ? (char*)(chunk + 1) : NULL;
+}
+
+void arena_destroy(region_t *region) {
+    if (!region) return;
+    arena_release_to_mark(region, NULL);
+    if (current_region == region) current_region = NULL;
+    free(region);
+}
+
+// Makes region the calling thread's current one, NULL for none, and returns
+// the one before so scopes nest. While a region is current, malloc(), calloc()
+// and realloc() allocate from it, and free() leaves its blocks alone.
+region_t *arena_scope(region_t *region) {
+    region_t *prev = current_region;
+    current_region = region;
+    return prev;
+}
+
+// size is a multiple of 16. What does not fit a standard chunk gets a chunk
+// of its own, which becomes the newest like any other.
+static void *region_bump(region_t *region, size_t size) {
+    char *next = region->next;
+    if (next && size <= (size_t)(region->chunks->end - next)) {
+        region->next = next + size;
+        return next;
+    }
+
+    size_t capacity = size > region->chunk_size ? size : region->chunk_size;
+    region_chunk_t *chunk = alloc_block(sizeof(region_chunk_t) + capacity, 0);
+    if (!chunk) return NULL;
+    chunk->prev = region->chunks;
+    chunk->end = (char*)(chunk + 1) + capacity;
+    region->chunks = chunk;
+    region->next = (char*)(chunk + 1) + size;
+    return chunk + 1;
+}
+
+// malloc() from a region in scope. The block gets a header like a heap
+// block, which tells free() to skip it and realloc() its size.
+static void *region_malloc(region_t *region, size_t size, int zero) {
+    if (size == 0) return NULL;
+    if (size > MAX_ALLOC_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = (size + ALIGNMENT) & ~(size_t)ALIGNMENT;
+    char *data = region_bump(region, size + REGION_HEADER_SIZE);
+    if (!data) return NULL;
+    data += REGION_HEADER_SIZE;
+    GET_BLOCK_PTR(data)->word = MAKE_HEADER(size, 0) | REGION_BLOCK;
+    if (zero) zero_block(data, size);
+    return data;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!ptr) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (size > MAX_ALLOC_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // A slab object stays put while the size keeps its class, which free_sized() relies on
+    if (IS_SLAB_OBJECT(ptr)) {
+        size_t object_size = GET_SLAB(ptr)->size;
+        if (size <= object_size && SLAB_CLASS(size) == SLAB_CLASS(object_size)) return ptr;
+        void *new_ptr = malloc(size);
+        if (!new_ptr) return NULL;
+        memcpy(new_ptr, ptr, size < object_size ? size : object_size);
         free(ptr);
-        remove_free_block(last_metadata);
         return new_ptr;
     }
 
+    metadata_t *block = GET_BLOCK_PTR(ptr);
+    if (IS_MMAPPED(block)) return mmap_resize(ptr, (size + ALIGNMENT) & ~(size_t)ALIGNMENT);
+
+    // A region block cannot be freed on its own, growing it takes a new block
+    if (IS_REGION_BLOCK(block)) {
+        if (size <= BLOCK_SIZE(block)) return ptr;
+        void *new_ptr = malloc(size);
+        if (new_ptr) copy_block(new_ptr, ptr, BLOCK_SIZE(block));
+        return new_ptr;
+    }
+    size_t block_size = BLOCK_DATA_SIZE(size);
+    if (block_size < MIN_BLOCK_SIZE) block_size = MIN_BLOCK_SIZE;
+    size_t old_size = BLOCK_SIZE(block);
+
+    // Resizing in place works on the neighbours, so it needs the owning arena's lock
+    arena_t *arena = BLOCK_ARENA(block);
+    lock_arena(arena);
+    void *resized = resize_block(arena, block, block_size);
+    pthread_mutex_unlock(&arena->lock);
+    if (resized) return resized;
+
     void *new_ptr = malloc(size);
     if (!new_ptr) return NULL;
-    memcpy(new_ptr, ptr, block->size);
+    copy_block(new_ptr, ptr, old_size);
     free(ptr);
     return new_ptr;
 }
 
-void *find_free_block(size_t size) {
-    unsigned int u_size = (unsigned int)size;
-    metadata_t *current = free_list;
-    
-    while (current) {
-        if (current->size >= u_size) {
-            remove_free_block(current);
-            current->free = 0;
-            if (current->size >= u_size + MIN_SPLIT_SIZE) {
-                split_block(current, u_size);
-            }
-            return (void*)(current + 1);
-        }
-        current = current->next;
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if ((alignment & (alignment - 1)) != 0 || alignment < sizeof(void*)) return EINVAL;
+    int saved_errno = errno;
+    void *ptr = alloc_aligned(alignment, size);
+    if (!ptr && size) {
+        errno = saved_errno;
+        return ENOMEM;
     }
+    *memptr = ptr;
+    return 0;
+}
 
-    return NULL;
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return alloc_aligned(alignment, size);
 }
 
-void *request_space(size_t size) {
-    // fprintf(stderr, "Requested: %lu\n", size);
-    // get_free_list();
-    unsigned int u_size = (unsigned int)size;
-    
-    if (!first_size) {
-        first_size = u_size;
-        first_block = (void*)sbrk(u_size);
-        if (first_block == SBRK_FAILURE) {
-            first_block = NULL;
+// Like glibc, an alignment that is not a power of two is rounded up to one
+void *memalign(size_t alignment, size_t size) {
+    if (alignment & (alignment - 1)) {
+        if (alignment > SIZE_MAX / 2 + 1) {
+            errno = EINVAL;
+            return NULL;
         }
-        return first_block;
+        alignment = (size_t)1 << (64 - __builtin_clzll(alignment));
     }
-    
-    metadata_t *block;
-    if (u_size >= MESSY_THRESHOLD) u_size += MESSY_ALLOC_SIZE;
-    // Calculate request size (with metadata)
-    unsigned int request_size = METADATA_SIZE + u_size;
-    
-    // Request memory from the system
-    block = sbrk(request_size);
-    if (block == SBRK_FAILURE) {
+    return alloc_aligned(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return alloc_aligned((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+// Rounds up to whole pages, pvalloc(0) gets one
+void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (size > MAX_ALLOC_SIZE) {
+        errno = ENOMEM;
         return NULL;
     }
-    // If this is the first metadata block, initialize first_block
-    if (!first_block) {
-        first_block = block;
+    size = size ? (size + page - 1) & ~(page - 1) : page;
+    return alloc_aligned(page, size);
+}
+
+// All of the block is the caller's, realloc() keeps every byte of it
+size_t malloc_usable_size(void *ptr) {
+    return ptr ? usable_size(ptr) : 0;
+}
+
+// What malloc(size) hands out at least: the slab class, the heap block
+// size or whole pages. The heap may add up to MIN_SPLIT_SIZE - 1 bytes more.
+size_t malloc_good_size(size_t size) {
+    pthread_once(&arenas_once, init_arenas);
+    if (size > MAX_ALLOC_SIZE) return size;
+    if (size == 0) size = 1;
+    size_t rounded = (size + ALIGNMENT) & ~(size_t)ALIGNMENT;
+    if (rounded <= SLAB_MAX_SIZE && slab_region_size) return (SLAB_CLASS(rounded) + 1) * SLAB_QUANTUM;
+    if (rounded >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        return ((rounded + sizeof(mmap_header_t) + page - 1) & ~(page - 1)) - sizeof(mmap_header_t);
     }
-    
-    // Initialize the new block
-    block->size = u_size;
-    block->prev = NULL;
-    block->next = NULL;
-    block->free = 0;  // Initially allocated
-    
-    // Update last_metadata to point to this new block
-    last_metadata = block;
-    
-    // Return pointer to the usable portion
-    return (void*)(block + 1);
+    size = BLOCK_DATA_SIZE(size);
+    return size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size;
 }
 
-void split_block(metadata_t *block, size_t size) {
-    unsigned int u_size = (unsigned int)size;
-    
-    // Calculate the position of the new block
-    metadata_t *new_block = (metadata_t*)((char*)(block + 1) + u_size);
-    
-    // Set up the new block
-    new_block->size = block->size - u_size - METADATA_SIZE;
-    new_block->prev = NULL;
-    new_block->next = NULL;
-    new_block->free = 1;  // The new block is free
-    
-    // Update original block size
-    block->size = u_size;
-    
-    // If the original block was the last block in the heap, update last_metadata
-    if (block == last_metadata) {
-        last_metadata = new_block;
+// Bytes from ptr to the end of its slab object, heap block or mapping
+static size_t usable_size(void *ptr) {
+    uintptr_t entry = pagemap_get(ptr);
+    if (entry) return PAGEMAP_SLAB(entry)->size;
+    metadata_t *block = GET_BLOCK_PTR(ptr);
+    if (!IS_MMAPPED(block)) return BLOCK_SIZE(block);
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)GET_MMAP_HEADER(ptr) & ~(uintptr_t)(page - 1);
+    return GET_MMAP_HEADER(ptr)->map_size - ((uintptr_t)ptr - start);
+}
+
+// alignment is a power of two. Up to alignof(max_align_t) every block will
+// do. Beyond, a slab class that is a multiple of the alignment, or a heap
+// block carved out of a larger one with the slack on either side freed
+// again, or a mapping cut down to an aligned span.
+static void *alloc_aligned(size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT + 1) return alloc_block(size, 0);
+    if (size == 0) return NULL;
+    if (size > MAX_ALLOC_SIZE || alignment > MAX_ALLOC_SIZE - size) {
+        errno = ENOMEM;
+        return NULL;
     }
-    
-    // Add the new block to the free list
-    insert_free_block(new_block);
+    // Slab pages are page aligned, so are objects whose size the alignment divides
+    arena_t *arena = get_thread_arena();
+    size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+    if (rounded <= SLAB_MAX_SIZE) {
+        void *object = small_alloc(arena, SLAB_CLASS(rounded));
+        if (object) return object;
+    }
+
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        return mmap_alloc_aligned((size + ALIGNMENT) & ~(size_t)ALIGNMENT, alignment);
+    }
+    size = BLOCK_DATA_SIZE(size);
+    if (size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
+
+    // Room for a free block in front of the aligned one, whatever the offset
+    int zeroed;
+    lock_arena(arena);
+    void *data = heap_alloc(arena, size + alignment + METADATA_SIZE + MIN_BLOCK_SIZE, &zeroed);
+    if (data) data = align_block(arena, data, alignment, size);
+    pthread_mutex_unlock(&arena->lock);
+    return data;
 }
 
-void insert_free_block(metadata_t *block) {
-    block->free = 1;
-    
-    metadata_t *next = free_list;
-    metadata_t *prev = NULL;
-    
-    while (next && (uintptr_t)next < (uintptr_t)block) {
-        prev = next;
-        next = next->next;
+// Caller holds the arena lock. Frees the part of an allocated block before
+// the first aligned address that leaves room for a free block there, and
+// the part beyond size. Returns the aligned data.
+static void *align_block(arena_t *arena, void *data, size_t alignment, size_t size) {
+    metadata_t *block = GET_BLOCK_PTR(data);
+    uintptr_t aligned = ((uintptr_t)data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned != (uintptr_t)data) {
+        if (aligned - (uintptr_t)data < METADATA_SIZE + MIN_BLOCK_SIZE) aligned += alignment;
+        metadata_t *aligned_block = GET_BLOCK_PTR(aligned);
+        size_t lead = aligned - (uintptr_t)data - METADATA_SIZE;
+        aligned_block->word = MAKE_HEADER(BLOCK_SIZE(block) - lead - METADATA_SIZE, arena->index);
+        SET_SIZE(block, lead);
+        free_heap_block(arena, block);
+        block = aligned_block;
     }
-    
-    // Check if we can coalesce with the previous block in the free list
-    if (prev && ARE_ADJACENT(prev, block)) {
-        // Coalesce with previous block
-        prev->size += METADATA_SIZE + block->size;
-        
-        // If this block was the last block, update last_metadata
-        if (block == last_metadata) {
-            last_metadata = prev;
+    if (BLOCK_SIZE(block) >= size + MIN_SPLIT_SIZE) {
+        split_block(arena, block, size);
+    }
+    return block + 1;
+}
+
+// Grows or shrinks the block using its neighbours, NULL when it has to move.
+// Caller holds the arena lock.
+static void *resize_block(arena_t *arena, metadata_t *block, size_t size) {
+    void *ptr = block + 1;
+
+    // If current block size is sufficient
+    if (BLOCK_SIZE(block) >= size) {
+        if (BLOCK_SIZE(block) >= size + MIN_SPLIT_SIZE) {
+            split_block(arena, block, size);
         }
-        
-        // Use the coalesced block for further operations
-        block = prev;
+        // get_free_list();
+        return ptr;
+    }
+
+    // Both neighbours are found through the header and btag, no list walk needed
+    metadata_t *prev_block = get_prev_block(block);
+    metadata_t *next_block = get_next_block(block);
+    size_t old_size = BLOCK_SIZE(block);
+    size_t total_size = old_size;
+
+    if (IS_FREE(next_block)) {
+        total_size += METADATA_SIZE + BLOCK_SIZE(next_block);
     } else {
-        // Insert the block in the free list
-        if (prev) {
-            // Insert after prev
-            block->next = prev->next;
-            block->prev = prev;
-            prev->next = block;
-            if (block->next) {
-                block->next->prev = block;
-            }
-        } else {
-            // Insert at the beginning
-            block->next = free_list;
-            block->prev = NULL;
-            if (free_list) {
-                free_list->prev = block;
-            }
-            free_list = block;
-        }
+        next_block = NULL;
     }
-    
-    // Check if we can coalesce with the next block in the free list
-    if (block->next && ARE_ADJACENT(block, block->next)) {
-        // Get the next block
-        metadata_t *next_block = block->next;
-        
-        // Coalesce with next block
-        block->size += METADATA_SIZE + next_block->size;
-        
-        // Remove next block from free list
-        block->next = next_block->next;
-        if (next_block->next) {
-            next_block->next->prev = block;
+
+    // Growing into the next block keeps the data in place
+    if (next_block && total_size >= size) {
+        remove_free_block(arena, next_block);
+        SET_SIZE(block, total_size);
+        get_next_block(block)->word &= ~PREV_FREE;
+        if (BLOCK_SIZE(block) >= size + MIN_SPLIT_SIZE) {
+            split_block(arena, block, size);
         }
-        
-        // If the next block was the last block, update last_metadata
-        if (next_block == last_metadata) {
-            last_metadata = block;
+        return ptr;
+    }
+
+    // The last block of the newest segment grows into the reservation, committing more of it
+    metadata_t *last = next_block ? next_block : block;
+    if (get_next_block(last) == arena->heap_top) {
+        char *end = (char*)(block + 1) + size + METADATA_SIZE;
+        if (end <= arena->reserve_end && end > (char*)block && commit_to(arena, end)) {
+            if (next_block) remove_free_block(arena, next_block);
+            SET_SIZE(block, size);
+            arena->heap_top = get_next_block(block);
+            arena->heap_top->word = MAKE_HEADER(0, arena->index);
+            return ptr;
         }
     }
 
-    if (!seen && !used_calloc && (block->size == G_ALLOC)
-    ) {
-        last_metadata = NULL, free_list = NULL; // Reset ptrs
-        sbrk(-1 * ((long)METADATA_SIZE + (long)block->size));
+    // Otherwise slide down into the previous block as well
+    if (prev_block && total_size + METADATA_SIZE + BLOCK_SIZE(prev_block) >= size) {
+        if (next_block) remove_free_block(arena, next_block);
+        remove_free_block(arena, prev_block);
+        SET_SIZE(prev_block, total_size + METADATA_SIZE + BLOCK_SIZE(prev_block));
+        prev_block->word &= ~ZEROED;
+        get_next_block(prev_block)->word &= ~PREV_FREE;
+        copy_block(prev_block + 1, ptr, old_size);
+        if (BLOCK_SIZE(prev_block) >= size + MIN_SPLIT_SIZE) {
+            split_block(arena, prev_block, size);
+        }
+        return prev_block + 1;
     }
+
+    return NULL;
 }
 
-void remove_free_block(metadata_t *block) {
-    block->free = 0;
-    if (block->prev) {
-        block->prev->next = block->next;
-    } else {
-        free_list = block->next;
+// Large blocks bypass the arenas: one private mapping each, the data
+// portion starting right after a compact mmap_header_t. Zeroed requests
+// skip the cache: clearing a reused mapping costs more than faulting in
+// fresh zero pages.
+static void *mmap_alloc(size_t size, int zero) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t map_size = (size + sizeof(mmap_header_t) + page - 1) & ~(page - 1);
+    mmap_header_t *header = zero ? NULL : large_cache_take(map_size);
+#ifdef MREMAP_MAYMOVE
+    if (header && header->map_size < map_size) {
+        void *map = mremap(header, header->map_size, map_size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED) {
+            munmap(header, header->map_size);
+            header = NULL;
+        } else {
+            header = map;
+            header->map_size = map_size;
+        }
     }
-    
-    if (block->next) {
-        block->next->prev = block->prev;
+#endif
+    if (header) {
+        header->block.word = MAKE_HEADER(size, 0) | MMAPPED;
+        return header + 1;
     }
-    
-    // Clear free list pointers
-    block->prev = NULL;
-    block->next = NULL;
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+    if (populate_threshold && size >= populate_threshold) flags |= MAP_POPULATE;
+#endif
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    header = map;
+    header->map_size = map_size;
+    header->block.word = MAKE_HEADER(size, 0) | MMAPPED;
+    return header + 1;
 }
 
-metadata_t *get_next_block(metadata_t *block) {
-    if (last_metadata == block) {
-        return NULL;  // ISSUE if last_metadata trash
+// The data starts alignment bytes into the mapping, or for alignments above
+// a page, a page into an aligned span cut out of a larger mapping. Either
+// way the header is in the mapping's first page, which is how mmap_free()
+// finds the start.
+static void *mmap_alloc_aligned(size_t size, size_t alignment) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t lead = alignment < page ? alignment : page;
+    size_t map_size = (size + lead + page - 1) & ~(page - 1);
+    size_t slack = alignment > page ? alignment : 0;
+    char *map = mmap(NULL, map_size + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    char *base = map;
+    if (slack) {
+        base = (char*)((((uintptr_t)map + lead + alignment - 1) & ~(uintptr_t)(alignment - 1)) - lead);
+        if (base > map) munmap(map, (size_t)(base - map));
+        if (map + slack > base) munmap(base + map_size, (size_t)(map + slack - base));
     }
-    return (metadata_t*)((char*)(block + 1) + block->size);
+    mmap_header_t *header = GET_MMAP_HEADER(base + lead);
+    header->map_size = map_size;
+    header->block.word = MAKE_HEADER(size, 0) | MMAPPED;
+    return header + 1;
 }
 
-// CHANGE with BTAG to O(1)
-metadata_t *get_prev_block(metadata_t *block) {
-    for (metadata_t *curr = free_list; curr; curr = curr->next) {
-        if (get_next_block(curr) == block) {
-            return curr;
+// Shrinking returns whole pages from the end of the mapping. Growing uses
+// mremap() where available, which moves page table entries instead of
+// copying the data. Shrinking below the threshold moves the data to the heap.
+static void *mmap_resize(void *ptr, size_t size) {
+    mmap_header_t *header = GET_MMAP_HEADER(ptr);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t needed = (size + sizeof(mmap_header_t) + page - 1) & ~(page - 1);
+    int offset = ((uintptr_t)header & (page - 1)) != 0;  // aligned blocks always move
+    size_t threshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+
+    if (size >= threshold && !offset && needed <= header->map_size) {
+        if (needed < header->map_size) {
+            munmap((char*)header + needed, header->map_size - needed);
+            header->map_size = needed;
         }
+        SET_SIZE(&header->block, size);
+        return ptr;
     }
-    return NULL;  // No previous free block found
-}
 
-void convert_first_block_to_metadata(int x) {
-    void *old_data = first_block;
-    unsigned int old_size = first_size;
-    
-    // Request new space with metadata
-    metadata_t *new_block = sbrk(METADATA_SIZE);
-    if (new_block == SBRK_FAILURE) {
-        return;  // Failed to allocate, leave as is
+#ifdef MREMAP_MAYMOVE
+    if (size >= threshold && !offset && mremap_enabled) {
+        void *map = mremap(header, header->map_size, needed, MREMAP_MAYMOVE);
+        if (map != MAP_FAILED) {
+            header = map;
+            header->map_size = needed;
+            SET_SIZE(&header->block, size);
+            return header + 1;
+        }
     }
-    
-    // Initialize the metadata structure
-    new_block->size = old_size;
-    new_block->free = first_free;
-    new_block->prev = NULL;
-    new_block->next = NULL;
-    
-    // Set first_block if not already set
-    first_block = new_block;
-    
-    // Set last_metadata to this block
-    last_metadata = new_block;
-    
-    if (!first_free) {
-        // Copy the data from the first allocation to the new area
-        memcpy((void*)(new_block + 1), old_data, old_size);
+#endif
+
+    void *new_ptr = malloc(size);
+    if (!new_ptr) return NULL;
+    size_t old_size = usable_size(ptr);
+    copy_block(new_ptr, ptr, old_size < size ? old_size : size);
+    mmap_free(ptr);
+    return new_ptr;
+}
+
+static void mmap_free(void *ptr) {
+    mmap_header_t *header = GET_MMAP_HEADER(ptr);
+    size_t map_size = header->map_size;
+
+    // Aligned blocks have their header further in, the cache wants it at the start
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    mmap_header_t *start = (mmap_header_t*)((uintptr_t)header & ~(uintptr_t)(page - 1));
+    start->map_size = map_size;
+    if (!large_cache_put(start)) munmap(start, map_size);
+
+    if (!mmap_threshold_fixed && map_size <= MMAP_THRESHOLD_MAX &&
+        map_size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&mmap_threshold, map_size, __ATOMIC_RELAXED);
+        if (!trim_threshold_fixed) {
+            __atomic_store_n(&trim_threshold, 2 * map_size, __ATOMIC_RELAXED);
+        }
     }
-    
-    // first_metadata = last_metadata;
-    if (!x) first_size = 1;
-}
\ No newline at end of file
+}
+
+// Best fitting cached mapping within the slack of map_size, which may be
+// smaller than map_size where mremap() can grow it. NULL if there is none.
+static mmap_header_t *large_cache_take(size_t map_size) {
+    if (!__atomic_load_n(&large_cache_bytes, __ATOMIC_RELAXED)) return NULL;
+
+    size_t slack = map_size >> LARGE_CACHE_SLACK_SHIFT;
+    pthread_mutex_lock(&large_cache_lock);
+    large_cache_expire(now_ms());
+    int best = -1;
+    size_t best_diff = slack + 1;
+    for (int i = 0; i < LARGE_CACHE_SLOTS; i++) {
+        if (!large_cache[i]) continue;
+        size_t cached = large_cache[i]->map_size;
+        size_t diff = cached > map_size ? cached - map_size : map_size - cached;
+#ifndef MREMAP_MAYMOVE
+        if (cached < map_size) continue;
+#endif
+        if (diff < best_diff) {
+            best = i;
+            best_diff = diff;
+        }
+    }
+    mmap_header_t *header = NULL;
+    if (best >= 0) {
+        header = large_cache[best];
+        large_cache[best] = NULL;
+        __atomic_store_n(&large_cache_bytes, large_cache_bytes - large_cache_resident[best], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&large_cache_lock);
+    return header;
+}
+
+// Keeps a freed mapping, making room by unmapping the oldest ones. 0 when
+// its resident pages alone exceed the budget and the caller has to unmap it.
+static int large_cache_put(mmap_header_t *header) {
+    if (!large_cache_budget || large_cache_ms <= 0) return 0;
+    size_t resident = resident_estimate(header);
+    if (resident > large_cache_budget) return 0;
+
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&large_cache_lock);
+    large_cache_expire(now);
+    for (;;) {
+        int free_slot = -1;
+        int oldest = -1;
+        for (int i = 0; i < LARGE_CACHE_SLOTS; i++) {
+            if (!large_cache[i]) {
+                free_slot = i;
+            } else if (oldest < 0 || large_cache_since[i] < large_cache_since[oldest]) {
+                oldest = i;
+            }
+        }
+        if (free_slot >= 0 && large_cache_bytes + resident <= large_cache_budget) {
+            large_cache[free_slot] = header;
+            large_cache_since[free_slot] = now;
+            large_cache_resident[free_slot] = resident;
+            __atomic_store_n(&large_cache_bytes, large_cache_bytes + resident, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_store_n(&large_cache_bytes, large_cache_bytes - large_cache_resident[oldest], __ATOMIC_RELAXED);
+        munmap(large_cache[oldest], large_cache[oldest]->map_size);
+        large_cache[oldest] = NULL;
+    }
+    pthread_mutex_unlock(&large_cache_lock);
+    return 1;
+}
+
+// Caller holds large_cache_lock. Unmaps what was cached for too long, and
+// everything when now is UINT64_MAX.
+static void large_cache_expire(uint64_t now) {
+    for (int i = 0; i < LARGE_CACHE_SLOTS; i++) {
+        if (large_cache[i] && now - large_cache_since[i] >= (uint64_t)large_cache_ms) {
+            __atomic_store_n(&large_cache_bytes, large_cache_bytes - large_cache_resident[i], __ATOMIC_RELAXED);
+            munmap(large_cache[i], large_cache[i]->map_size);
+            large_cache[i] = NULL;
+        }
+    }
+}
+
+// Resident bytes of a mapping, scaled up from the share of resident pages in
+// a window that moves with every call, so mappings touched in part average
+// out. The header page always counts. Without mincore() all of it does.
+static size_t resident_estimate(mmap_header_t *header) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = header->map_size / page;
+    if (pages <= LARGE_CACHE_SAMPLE_PAGES + 1) return header->map_size;
+
+    unsigned int sample = __atomic_fetch_add(&large_cache_samples, 1, __ATOMIC_RELAXED);
+    size_t first = 1 + (size_t)(sample * 2654435761u) % (pages - LARGE_CACHE_SAMPLE_PAGES);
+    unsigned char vec[LARGE_CACHE_SAMPLE_PAGES];
+    if (mincore((char*)header + first * page, LARGE_CACHE_SAMPLE_PAGES * page, vec) != 0) {
+        return header->map_size;
+    }
+    size_t hits = 0;
+    for (int i = 0; i < LARGE_CACHE_SAMPLE_PAGES; i++) hits += vec[i] & 1;
+    return page + (pages - 1) / LARGE_CACHE_SAMPLE_PAGES * hits * page;
+}
+
+// Caller holds the arena lock. Objects come from the freed list of the first
+// partial slab, then from its untouched tail. NULL when no slab can be had.
+static void *slab_alloc(arena_t *arena, unsigned int cls) {
+    slab_t *slab = arena->partial_slabs[cls];
+    if (!slab) {
+        slab = new_slab(arena, cls);
+        if (!slab) return NULL;
+    }
+
+    void *ptr = slab->free_objects;
+    if (ptr) {
+        slab->free_objects = NEXT_OBJECT(ptr);
+    } else {
+        ptr = slab->base + (size_t)slab->carved++ * slab->size;
+    }
+
+    if (++slab->used == slab->capacity) {
+        arena->partial_slabs[cls] = slab->next;
+        if (slab->next) slab->next->prev = NULL;
+        slab->next = NULL;
+        slab->state = SLAB_FULL;
+    }
+    return ptr;
+}
+
+// Same for up to n objects in one pass: each slab's freed objects, then a run
+// carved from its tail at once. Fewer only when no slab can be had.
+static size_t slab_alloc_batch(arena_t *arena, unsigned int cls, size_t n, void **ptrs) {
+    size_t got = 0;
+    while (got < n) {
+        slab_t *slab = arena->partial_slabs[cls];
+        if (!slab && !(slab = new_slab(arena, cls))) break;
+
+        size_t before = got;
+        while (got < n && slab->free_objects) {
+            ptrs[got++] = slab->free_objects;
+            slab->free_objects = NEXT_OBJECT(slab->free_objects);
+        }
+        size_t run = (size_t)(slab->capacity - slab->carved);
+        if (run > n - got) run = n - got;
+        char *object = slab->base + (size_t)slab->carved * slab->size;
+        for (size_t i = 0; i < run; i++, object += slab->size) ptrs[got++] = object;
+        slab->carved += run;
+        slab->used += got - before;
+
+        if (slab->used == slab->capacity) {
+            arena->partial_slabs[cls] = slab->next;
+            if (slab->next) slab->next->prev = NULL;
+            slab->next = NULL;
+            slab->state = SLAB_FULL;
+        }
+    }
+    return got;
+}
+
+// Reuses one of the arena's empty slabs, else carves a new one from the slab region
+static slab_t *new_slab(arena_t *arena, unsigned int cls) {
+    slab_t *slab = arena->empty_slabs;
+    if (slab) {
+        arena->empty_slabs = slab->next;
+    } else {
+        // Each run, a huge page when those are on, is only ever used by one arena
+        if (!arena->slab_run_left) {
+            size_t offset = __atomic_fetch_add(&slab_region_used, SLAB_RUN_SIZE, __ATOMIC_RELAXED);
+            if (offset >= slab_region_size) return NULL;
+            arena->slab_run = slab_base + offset;
+            arena->slab_run_left = SLAB_RUN_SIZE;
+        }
+        slab = alloc_slab_desc(arena);
+        if (!slab) return NULL;
+        slab->base = arena->slab_run;
+        arena->slab_run += SLAB_SIZE;
+        arena->slab_run_left -= SLAB_SIZE;
+    }
+    // The page is empty, so no other thread can be looking up its entry
+    if (!pagemap_set(slab->base, (uintptr_t)slab | cls)) return NULL;
+
+    slab->prev = NULL;
+    slab->next = NULL;
+    slab->free_objects = NULL;
+    slab->size = (cls + 1) * SLAB_QUANTUM;
+    slab->cls = cls;
+    slab->used = 0;
+    slab->carved = 0;
+    slab->capacity = SLAB_SIZE / slab->size;
+    slab->arena = arena->index;
+    slab->state = SLAB_PARTIAL;
+    arena->partial_slabs[cls] = slab;
+    return slab;
+}
+
+// Caller holds the lock of the slab's arena. A slab that runs empty moves
+// to the empty list unless it is the only partial slab of its class.
+static void slab_free(arena_t *arena, void *ptr) {
+    slab_t *slab = GET_SLAB(ptr);
+    NEXT_OBJECT(ptr) = slab->free_objects;
+    slab->free_objects = ptr;
+    slab->used--;
+
+    slab_t **partial = &arena->partial_slabs[slab->cls];
+    if (slab->state == SLAB_FULL) {
+        slab->prev = NULL;
+        slab->next = *partial;
+        if (*partial) (*partial)->prev = slab;
+        *partial = slab;
+        slab->state = SLAB_PARTIAL;
+    }
+
+    if (!slab->used && (slab->prev || slab->next)) {
+        if (slab->prev) slab->prev->next = slab->next;
+        else *partial = slab->next;
+        if (slab->next) slab->next->prev = slab->prev;
+        slab->prev = NULL;
+        slab->next = arena->empty_slabs;
+        arena->empty_slabs = slab;
+        slab->state = SLAB_EMPTY;
+    }
+}
+
+static slab_t *alloc_slab_desc(arena_t *arena) {
+    if (!arena->spare_desc_count) {
+        void *chunk = mmap(NULL, SLAB_DESC_CHUNK, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) return NULL;
+        arena->spare_descs = chunk;
+        arena->spare_desc_count = SLAB_DESC_CHUNK / sizeof(slab_t);
+    }
+    arena->spare_desc_count--;
+    return arena->spare_descs++;
+}
+
+// Lock-free, 0 for any page that is not a slab
+static uintptr_t pagemap_get(const void *ptr) {
+    uintptr_t page = (uintptr_t)ptr >> PAGE_SHIFT;
+    pagemap_node_t *node = __atomic_load_n(&pagemap[PAGEMAP_INDEX(page, 2)], __ATOMIC_ACQUIRE);
+    if (!node) return 0;
+    pagemap_leaf_t *leaf = __atomic_load_n(&node->leaves[PAGEMAP_INDEX(page, 1)], __ATOMIC_ACQUIRE);
+    if (!leaf) return 0;
+    return __atomic_load_n(&leaf->entries[PAGEMAP_INDEX(page, 0)], __ATOMIC_RELAXED);
+}
+
+// Creates the missing levels on the way, 0 when a level could not be mapped
+static int pagemap_set(const void *ptr, uintptr_t entry) {
+    uintptr_t page = (uintptr_t)ptr >> PAGE_SHIFT;
+    pagemap_node_t *node = pagemap_alloc_node((void**)&pagemap[PAGEMAP_INDEX(page, 2)], sizeof(pagemap_node_t));
+    if (!node) return 0;
+    pagemap_leaf_t *leaf = pagemap_alloc_node((void**)&node->leaves[PAGEMAP_INDEX(page, 1)], sizeof(pagemap_leaf_t));
+    if (!leaf) return 0;
+    __atomic_store_n(&leaf->entries[PAGEMAP_INDEX(page, 0)], entry, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Returns the level stored in slot, installing a fresh zeroed one if it is empty.
+// Arenas race for the same slot without a common lock, the loser unmaps its copy.
+static void *pagemap_alloc_node(void **slot, size_t size) {
+    void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (node) return node;
+
+    void *fresh = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fresh == MAP_FAILED) return NULL;
+    if (__atomic_compare_exchange_n(slot, &node, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return fresh;
+    }
+    munmap(fresh, size);
+    return node;
+}
+
+// Reserves the address space slabs are carved from. Pages are only backed
+// once touched, so the reservation itself costs no memory.
+static void init_slabs(void) {
+    for (size_t size = SLAB_REGION_SIZE; size >= SLAB_REGION_MIN; size /= 2) {
+        void *region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED) continue;
+
+        // Runs of slabs are handed out whole, so the region starts on a run boundary
+        uintptr_t start = ((uintptr_t)region + SLAB_RUN_SIZE - 1) & ~(uintptr_t)(SLAB_RUN_SIZE - 1);
+        slab_base = (char*)start;
+        slab_region_size = (size - (start - (uintptr_t)region)) & ~(size_t)(SLAB_RUN_SIZE - 1);
+        advise_huge(slab_base, slab_region_size);
+        return;
+    }
+}
+
+void *find_free_block(arena_t *arena, size_t size) {
+    unsigned int cls = size_class(size);
+
+    // The request's own class mixes smaller and larger blocks, so look at a few
+    metadata_t *current = arena->free_lists[cls];
+    for (int scanned = 0; current && scanned < FIT_SCAN_LIMIT; scanned++) {
+        if (BLOCK_SIZE(current) >= size) return take_free_block(arena, current, size);
+        current = LINKS(current)->next;
+    }
+
+    // Every block in a higher class fits, so the head of the first non-empty one will do
+    int fit = next_nonempty_class(arena, cls + 1);
+    if (fit < 0) return NULL;
+    return take_free_block(arena, arena->free_lists[fit], size);
+}
+
+// A ZEROED block stays flagged for heap_alloc(), with its links and btag
+// cleared so the whole data portion is zero
+static void *take_free_block(arena_t *arena, metadata_t *block, size_t size) {
+    remove_free_block(arena, block);
+    if (block->word & ZEROED) {
+        memset(LINKS(block), 0, sizeof(free_links_t));
+        *GET_BTAG_PTR(block) = 0;
+    }
+    get_next_block(block)->word &= ~PREV_FREE;
+    if (BLOCK_SIZE(block) >= size + MIN_SPLIT_SIZE) {
+        split_block(arena, block, size);
+    }
+    return block + 1;
+}
+
+static unsigned int size_class(size_t size) {
+    if (size < (1u << MIN_CLASS_SHIFT)) return 0;
+    unsigned int shift = 63 - __builtin_clzll(size);
+    unsigned int step = (size >> (shift - 2)) & (CLASS_STEPS - 1);
+    return 1 + (shift - MIN_CLASS_SHIFT) * CLASS_STEPS + step;
+}
+
+// Lowest non-empty class at or above cls, -1 if there is none
+static int next_nonempty_class(arena_t *arena, unsigned int cls) {
+    unsigned int word = cls / 64;
+    if (word >= BITMAP_WORDS) return -1;
+    uint64_t bits = arena->nonempty_classes[word] & (~0ULL << (cls % 64));
+    while (!bits) {
+        if (++word >= BITMAP_WORDS) return -1;
+        bits = arena->nonempty_classes[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+// Every heap segment ends in a zero sized, never free fencepost header, so
+// get_next_block() always lands on a real header. While the reservation has
+// room, the fencepost (and a free block right before it) is reused as the
+// start of the new block, otherwise a new segment is reserved.
+void *request_space(arena_t *arena, size_t size) {
+    // fprintf(stderr, "Requested: %lu\n", size);
+    // get_free_list();
+    size = BLOCK_DATA_SIZE(size);
+    if (size >= MESSY_THRESHOLD) size += MESSY_ALLOC_SIZE;
+
+    metadata_t *heap_top = arena->heap_top;
+    metadata_t *block = heap_top;
+    if (heap_top && (heap_top->word & PREV_FREE)) block = get_prev_block(heap_top);
+    char *end = (char*)(block + 1) + size + METADATA_SIZE;
+
+    if (!heap_top || end > arena->reserve_end || end < (char*)block) {
+        block = reserve_segment(arena, size);
+        if (!block) return NULL;
+        block->word = MAKE_HEADER(size, arena->index) | ZEROED;
+    } else {
+        if (!commit_to(arena, end)) return NULL;
+        uint64_t zeroed = ZEROED;  // Everything past the fencepost is fresh, see trim_heap()
+        if (block != heap_top) {
+            remove_free_block(arena, block);
+            zeroed = block->word & ZEROED;
+            if (zeroed) {
+                // Links and btag of the reused block, and the old fencepost, are all that is not zero
+                memset(LINKS(block), 0, sizeof(free_links_t));
+                memset((char*)heap_top - BTAG_SIZE, 0, BTAG_SIZE + METADATA_SIZE);
+            }
+        }
+        // Initially allocated, a reused fencepost keeps its PREV_FREE bit
+        block->word = MAKE_HEADER(size, arena->index) | (block->word & PREV_FREE) | zeroed;
+    }
+
+    // Close the segment with a new fencepost
+    heap_top = get_next_block(block);
+    heap_top->word = MAKE_HEADER(0, arena->index);
+    arena->heap_top = heap_top;
+    
+    // Return pointer to the usable portion
+    return (void*)(block + 1);
+}
+
+// Reserves a new segment, ARENA_ALIGNMENT aligned, whose first block has
+// room for size bytes and is already committed. The block's header starts
+// METADATA_SIZE in, which aligns its data to 16 bytes. The older segment keeps its
+// fencepost and whatever free block lies before it.
+static metadata_t *reserve_segment(arena_t *arena, size_t size) {
+    size_t unit = release_unit();
+    size_t need = (size + 3 * METADATA_SIZE + unit - 1) & ~(unit - 1);
+    size_t length = ARENA_RESERVE_SIZE;
+    char *map;
+    for (;;) {
+        if (length < need) length = need;
+        map = mmap(NULL, length + ARENA_ALIGNMENT, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map != MAP_FAILED || length == need || length <= ARENA_RESERVE_MIN) break;
+        length /= 2;
+    }
+    if (map == MAP_FAILED) return NULL;
+
+    // Cut the reservation down to an aligned start
+    char *base = (char*)(((uintptr_t)map + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1));
+    if (base > map) munmap(map, (size_t)(base - map));
+    munmap(base + length, (size_t)(map + ARENA_ALIGNMENT - base));
+
+    size_t commit = need < COMMIT_MIN ? (COMMIT_MIN + unit - 1) & ~(unit - 1) : need;
+    if (commit > length) commit = length;
+    advise_huge(base, length);
+    if (mprotect(base, commit, PROT_READ | PROT_WRITE) != 0) {
+        munmap(base, length);
+        return NULL;
+    }
+    arena->segment_base = base;
+    arena->commit_end = base + commit;
+    arena->reserve_end = base + length;
+    return (metadata_t*)base + 1;
+}
+
+// Makes the newest segment read/write up to at least end, committing at
+// least as much again as the segment already has, within COMMIT_MIN..COMMIT_MAX
+static int commit_to(arena_t *arena, char *end) {
+    if (end <= arena->commit_end) return 1;
+
+    size_t unit = release_unit();
+    size_t step = (size_t)(arena->commit_end - arena->segment_base);
+    if (step < COMMIT_MIN) step = COMMIT_MIN;
+    if (step > COMMIT_MAX) step = COMMIT_MAX;
+    step = (step + unit - 1) & ~(unit - 1);
+    char *target = (char*)(((uintptr_t)end + unit - 1) & ~(uintptr_t)(unit - 1));
+    if (target < arena->commit_end + step) target = arena->commit_end + step;
+    if (target > arena->reserve_end) target = arena->reserve_end;
+
+    if (mprotect(arena->commit_end, (size_t)(target - arena->commit_end), PROT_READ | PROT_WRITE) != 0) {
+        return 0;
+    }
+    arena->commit_end = target;
+    return 1;
+}
+
+// Granularity memory is committed and given back in
+static size_t release_unit(void) {
+    return thp_enabled ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void advise_huge(void *start, size_t length) {
+#ifdef MADV_HUGEPAGE
+    if (thp_enabled) madvise(start, length, MADV_HUGEPAGE);
+#else
+    (void)start;
+    (void)length;
+#endif
+}
+
+// memmove() for block data. The streaming kernels copy forwards, which is
+// enough: where source and destination overlap, the destination is lower.
+static void copy_block(void *dst, const void *src, size_t n) {
+    if (stream_copy && n >= stream_threshold) stream_copy(dst, src, n);
+    else memmove(dst, src, n);
+}
+
+static void zero_block(void *dst, size_t n) {
+    if (stream_zero && n >= stream_threshold) stream_zero(dst, n);
+    else memset(dst, 0, n);
+}
+
+// name is ALLOC_COPY_KERNEL: "libc", "avx2" or "avx512". Anything else, or a
+// kernel the CPU lacks, gets the widest one it has.
+static void select_copy_kernel(const char *name) {
+    if (name && strcmp(name, "libc") == 0) return;
+#ifdef STREAM_SUPPORTED
+    __builtin_cpu_init();
+    int avx512 = __builtin_cpu_supports("avx512f");
+    int avx2 = __builtin_cpu_supports("avx2");
+    if (avx2 && name && strcmp(name, "avx2") == 0) avx512 = 0;
+    if (avx512) {
+        stream_copy = stream_copy_avx512;
+        stream_zero = stream_zero_avx512;
+    } else if (avx2) {
+        stream_copy = stream_copy_avx2;
+        stream_zero = stream_zero_avx2;
+    }
+#endif
+}
+
+#ifdef STREAM_SUPPORTED
+// The kernels align the destination with libc, stream whole 128 or 256 byte
+// chunks past the caches, and leave the tail to libc again. Each chunk is
+// loaded before any of it is stored, so a lower overlapping destination
+// never overwrites source bytes still to be read.
+__attribute__((target("avx2")))
+static void stream_copy_avx2(char *dst, const char *src, size_t n) {
+    size_t head = (size_t)(-(uintptr_t)dst & 31);
+    if (head > n) head = n;
+    memmove(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+    for (; n >= 128; n -= 128, dst += 128, src += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)src);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+        _mm256_stream_si256((__m256i*)dst, a);
+        _mm256_stream_si256((__m256i*)(dst + 32), b);
+        _mm256_stream_si256((__m256i*)(dst + 64), c);
+        _mm256_stream_si256((__m256i*)(dst + 96), d);
+    }
+    _mm_sfence();
+    memmove(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void stream_zero_avx2(char *dst, size_t n) {
+    size_t head = (size_t)(-(uintptr_t)dst & 31);
+    if (head > n) head = n;
+    memset(dst, 0, head);
+    dst += head;
+    n -= head;
+    __m256i zero = _mm256_setzero_si256();
+    for (; n >= 128; n -= 128, dst += 128) {
+        _mm256_stream_si256((__m256i*)dst, zero);
+        _mm256_stream_si256((__m256i*)(dst + 32), zero);
+        _mm256_stream_si256((__m256i*)(dst + 64), zero);
+        _mm256_stream_si256((__m256i*)(dst + 96), zero);
+    }
+    _mm_sfence();
+    memset(dst, 0, n);
+}
+
+__attribute__((target("avx512f")))
+static void stream_copy_avx512(char *dst, const char *src, size_t n) {
+    size_t head = (size_t)(-(uintptr_t)dst & 63);
+    if (head > n) head = n;
+    memmove(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+    for (; n >= 256; n -= 256, dst += 256, src += 256) {
+        __m512i a = _mm512_loadu_si512(src);
+        __m512i b = _mm512_loadu_si512(src + 64);
+        __m512i c = _mm512_loadu_si512(src + 128);
+        __m512i d = _mm512_loadu_si512(src + 192);
+        _mm512_stream_si512((void*)dst, a);
+        _mm512_stream_si512((void*)(dst + 64), b);
+        _mm512_stream_si512((void*)(dst + 128), c);
+        _mm512_stream_si512((void*)(dst + 192), d);
+    }
+    _mm_sfence();
+    memmove(dst, src, n);
+}
+
+__attribute__((target("avx512f")))
+static void stream_zero_avx512(char *dst, size_t n) {
+    size_t head = (size_t)(-(uintptr_t)dst & 63);
+    if (head > n) head = n;
+    memset(dst, 0, head);
+    dst += head;
+    n -= head;
+    __m512i zero = _mm512_setzero_si512();
+    for (; n >= 256; n -= 256, dst += 256) {
+        _mm512_stream_si512((void*)dst, zero);
+        _mm512_stream_si512((void*)(dst + 64), zero);
+        _mm512_stream_si512((void*)(dst + 128), zero);
+        _mm512_stream_si512((void*)(dst + 192), zero);
+    }
+    _mm_sfence();
+    memset(dst, 0, n);
+}
+#endif
+
+// The tail becomes a new free block, ZEROED if the block was
+void split_block(arena_t *arena, metadata_t *block, size_t size) {
+    // Calculate the position of the new block
+    metadata_t *new_block = (metadata_t*)((char*)(block + 1) + size);
+    
+    // Set up the new block
+    new_block->word = MAKE_HEADER(BLOCK_SIZE(block) - size - METADATA_SIZE, arena->index) | (block->word & ZEROED);
+    
+    // Update original block size
+    SET_SIZE(block, size);
+    
+    // Add the new block to the free list
+    insert_free_block(arena, new_block);
+}
+
+// Coalesces the block with its free neighbours and files the result, which is returned
+metadata_t *insert_free_block(arena_t *arena, metadata_t *block) {
+    // Coalesce with the next block, found from our own size
+    metadata_t *next = get_next_block(block);
+    if (IS_FREE(next)) {
+        remove_free_block(arena, next);
+        merge_zeroed(block, next);
+        SET_SIZE(block, BLOCK_SIZE(block) + METADATA_SIZE + BLOCK_SIZE(next));
+    }
+
+    // Coalesce with the previous block, found from its btag
+    if (block->word & PREV_FREE) {
+        metadata_t *prev = get_prev_block(block);
+        remove_free_block(arena, prev);
+        merge_zeroed(prev, block);
+        SET_SIZE(prev, BLOCK_SIZE(prev) + METADATA_SIZE + BLOCK_SIZE(block));
+        block = prev;
+    }
+
+    block->word |= BLOCK_FREE;
+    SET_BTAG(block);
+    get_next_block(block)->word |= PREV_FREE;
+    file_free_block(arena, block);
+    return block;
+}
+
+// Puts a free block at the head of its class
+static void file_free_block(arena_t *arena, metadata_t *block) {
+    unsigned int cls = size_class(BLOCK_SIZE(block));
+    LINKS(block)->prev = NULL;
+    LINKS(block)->next = arena->free_lists[cls];
+    if (arena->free_lists[cls]) {
+        LINKS(arena->free_lists[cls])->prev = block;
+    }
+    arena->free_lists[cls] = block;
+    arena->nonempty_classes[cls / 64] |= 1ULL << (cls % 64);
+
+    // Big enough blocks that are not known to be zero start to decay
+    char *start, *end;
+    if ((block->word & ZEROED) || dirty_decay_ms < 0 ||
+        BLOCK_SIZE(block) < __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED) ||
+        !purge_range(block, &start, &end)) {
+        return;
+    }
+    decay_push(&arena->dirty, block, now_ms());
+    arena->dirty.bytes += (size_t)(end - start);
+    block->word |= DIRTY;
+}
+
+// Caller holds the arena lock. A block that starts to decay gets its
+// arena's expired blocks purged right away.
+static void free_heap_block(arena_t *arena, metadata_t *block) {
+    block = insert_free_block(arena, block);
+    decay_maybe(arena, (block->word & DIRTY) != 0);
+}
+
+// Shrinks the newest segment so the free block before its fencepost keeps
+// at least pad bytes. Pages past the new fencepost are replaced by fresh,
+// uncommitted ones, which keeps everything past it zero. Returns 1 if any
+// were given back.
+static int trim_heap(arena_t *arena, size_t pad) {
+    metadata_t *top = arena->heap_top;
+    if (!(top->word & PREV_FREE)) return 0;
+
+    size_t unit = release_unit();
+    metadata_t *block = get_prev_block(top);
+    if (pad < MIN_BLOCK_SIZE) pad = MIN_BLOCK_SIZE;
+    char *new_end = (char*)(((uintptr_t)(block + 1) + pad + METADATA_SIZE + unit - 1) & ~(uintptr_t)(unit - 1));
+    char *old_end = (char*)(((uintptr_t)(top + 1) + unit - 1) & ~(uintptr_t)(unit - 1));
+    if (new_end < arena->pinned_end && old_end > arena->pinned_start) new_end = arena->pinned_end;
+    if (new_end >= old_end) return 0;
+    if (mmap(new_end, (size_t)(arena->commit_end - new_end), PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        return 0;
+    }
+    advise_huge(new_end, (size_t)(arena->commit_end - new_end));  // the fresh mapping lost the advice
+    arena->commit_end = new_end;
+
+    remove_free_block(arena, block);
+    top = (metadata_t*)new_end - 1;
+    top->word = MAKE_HEADER(0, arena->index) | PREV_FREE;
+    arena->heap_top = top;
+    arena->purged_bytes += (size_t)(old_end - new_end);
+    SET_SIZE(block, (char*)top - (char*)(block + 1));
+    block->word |= BLOCK_FREE;
+    SET_BTAG(block);
+    file_free_block(arena, block);
+    return 1;
+}
+
+// The whole pages (huge pages with ALLOC_THP) of a free block that can be
+// given back: everything between its links and its btag. 0 when there are none.
+static int purge_range(metadata_t *block, char **start, char **end) {
+    size_t unit = release_unit();
+    uintptr_t data = (uintptr_t)DECAY_LINKS(block) + sizeof(decay_links_t);
+    uintptr_t data_end = (uintptr_t)GET_BTAG_PTR(block);
+    *start = (char*)((data + unit - 1) & ~(unit - 1));
+    *end = (char*)(data_end & ~(unit - 1));
+
+    // Pretouched pages stay, the range only overlaps them at one end
+    arena_t *arena = BLOCK_ARENA(block);
+    if (*start < arena->pinned_end && *end > arena->pinned_start) {
+        if (*start >= arena->pinned_start) *start = arena->pinned_end;
+        else *end = arena->pinned_start;
+    }
+    return *end > *start;
+}
+
+// Releases the pages of a free block that is in no decay list. They read
+// back as zeros, so the rest of the data is cleared too and the block becomes ZEROED.
+static void purge_block(arena_t *arena, metadata_t *block) {
+    char *start, *end;
+    if ((block->word & ZEROED) || !purge_range(block, &start, &end)) return;
+    if (madvise(start, (size_t)(end - start), MADV_DONTNEED) != 0) return;
+
+    char *data = (char*)(LINKS(block) + 1);
+    memset(data, 0, (size_t)(start - data));
+    memset(end, 0, (size_t)((char*)GET_BTAG_PTR(block) - end));
+    block->word |= ZEROED;
+    arena->purged_bytes += (size_t)(end - start);
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Appends as the newest block, byte counts and flags are left to the caller
+static void decay_push(decay_list_t *list, metadata_t *block, uint64_t now) {
+    decay_links_t *links = DECAY_LINKS(block);
+    links->prev = list->tail;
+    links->next = NULL;
+    links->since = now;
+    if (list->tail) DECAY_LINKS(list->tail)->next = block;
+    else list->head = block;
+    list->tail = block;
+}
+
+// Takes a DIRTY or MUZZY block out of its list
+static void decay_unlink(arena_t *arena, metadata_t *block) {
+    decay_list_t *list = (block->word & DIRTY) ? &arena->dirty : &arena->muzzy;
+    decay_links_t *links = DECAY_LINKS(block);
+    if (links->prev) DECAY_LINKS(links->prev)->next = links->next;
+    else list->head = links->next;
+    if (links->next) DECAY_LINKS(links->next)->prev = links->prev;
+    else list->tail = links->prev;
+
+    char *start, *end;
+    purge_range(block, &start, &end);
+    list->bytes -= (size_t)(end - start);
+    block->word &= ~(DIRTY | MUZZY);
+}
+
+// Caller holds the arena lock. Moves every block whose time is up one phase
+// on: dirty ones to muzzy or straight to purged, muzzy ones to purged. A
+// dirty block at the top of the newest segment is trimmed instead.
+static void decay_step(arena_t *arena, uint64_t now) {
+    metadata_t *block;
+    while ((block = arena->dirty.head) && now - DECAY_LINKS(block)->since >= (uint64_t)dirty_decay_ms) {
+        decay_unlink(arena, block);
+        if (get_next_block(block) == arena->heap_top && trim_heap(arena, 0)) {
+            continue;
+        }
+#ifdef MADV_FREE
+        char *start, *end;
+        if (muzzy_decay_ms != 0 && purge_range(block, &start, &end) &&
+            madvise(start, (size_t)(end - start), MADV_FREE) == 0) {
+            decay_push(&arena->muzzy, block, now);
+            arena->muzzy.bytes += (size_t)(end - start);
+            block->word |= MUZZY;
+            continue;
+        }
+#endif
+        purge_block(arena, block);
+    }
+
+    while (muzzy_decay_ms > 0 && (block = arena->muzzy.head) &&
+           now - DECAY_LINKS(block)->since >= (uint64_t)muzzy_decay_ms) {
+        decay_unlink(arena, block);
+        purge_block(arena, block);
+    }
+}
+
+// Caller holds the arena lock. While blocks wait, only every
+// DECAY_CHECK_INTERVAL-th call reads the clock, unless forced. Cached
+// mappings age out here too, so they are given back while the program only
+// makes small requests. Another thread expiring them already is enough.
+static void decay_maybe(arena_t *arena, int force) {
+    int cached = __atomic_load_n(&large_cache_bytes, __ATOMIC_RELAXED) != 0;
+    if (!arena->dirty.head && !arena->muzzy.head && !cached) return;
+    if (!force && ++arena->decay_ticks < DECAY_CHECK_INTERVAL) return;
+    arena->decay_ticks = 0;
+    uint64_t now = now_ms();
+    decay_step(arena, now);
+    if (cached && pthread_mutex_trylock(&large_cache_lock) == 0) {
+        large_cache_expire(now);
+        pthread_mutex_unlock(&large_cache_lock);
+    }
+}
+
+// Purges expired blocks of idle arenas too, which decay_maybe() never sees
+static void *background_purge(void *unused) {
+    (void)unused;
+    struct timespec tick = { DECAY_TICK_MS / 1000, (DECAY_TICK_MS % 1000) * 1000000L };
+    for (;;) {
+        nanosleep(&tick, NULL);
+        uint64_t now = now_ms();
+        for (unsigned int i = 0; i < num_arenas; i++) {
+            lock_arena(&arenas[i]);
+            decay_step(&arenas[i], now);
+            pthread_mutex_unlock(&arenas[i].lock);
+        }
+        pthread_mutex_lock(&large_cache_lock);
+        large_cache_expire(now);
+        pthread_mutex_unlock(&large_cache_lock);
+    }
+    return NULL;
+}
+
+// Called without any arena lock held, pthread_create() allocates
+static void start_background_thread(void) {
+    char started = 0;
+    if (!__atomic_compare_exchange_n(&background_thread_started, &started, 1, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    // The thread outlives any region, what pthread_create() allocates must not go to one
+    region_t *region = arena_scope(NULL);
+    pthread_create(&thread, &attr, background_purge, NULL);
+    arena_scope(region);
+    pthread_attr_destroy(&attr);
+}
+
+// Pages waiting in the dirty and muzzy lists, and pages given back for good
+// so far, summed over all arenas. Any pointer may be NULL.
+void malloc_decay_stats(size_t *dirty, size_t *muzzy, size_t *purged) {
+    pthread_once(&arenas_once, init_arenas);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t totals[3] = {0, 0, 0};
+    for (unsigned int i = 0; i < num_arenas; i++) {
+        lock_arena(&arenas[i]);
+        totals[0] += arenas[i].dirty.bytes;
+        totals[1] += arenas[i].muzzy.bytes;
+        totals[2] += arenas[i].purged_bytes;
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    if (dirty) *dirty = totals[0] / page;
+    if (muzzy) *muzzy = totals[1] / page;
+    if (purged) *purged = totals[2] / page;
+}
+
+// Gives back the free top of each arena beyond pad bytes, the cached
+// mappings and the pages of every free block and empty slab. Returns 1 if
+// memory was released.
+int malloc_trim(size_t pad) {
+    pthread_once(&arenas_once, init_arenas);
+    pthread_mutex_lock(&large_cache_lock);
+    int released = large_cache_bytes != 0;
+    large_cache_expire(UINT64_MAX);
+    pthread_mutex_unlock(&large_cache_lock);
+    for (unsigned int i = 0; i < num_arenas; i++) {
+        arena_t *arena = &arenas[i];
+        lock_arena(arena);
+        size_t purged = arena->purged_bytes;
+        if (arena->heap_top) trim_heap(arena, pad);
+        for (int cls = next_nonempty_class(arena, 0); cls >= 0; cls = next_nonempty_class(arena, cls + 1)) {
+            for (metadata_t *curr = arena->free_lists[cls]; curr; curr = LINKS(curr)->next) {
+                if (curr->word & (DIRTY | MUZZY)) decay_unlink(arena, curr);
+                purge_block(arena, curr);
+            }
+        }
+        for (slab_t *slab = arena->empty_slabs; slab && !thp_enabled; slab = slab->next) {
+            if (madvise(slab->base, SLAB_SIZE, MADV_DONTNEED) == 0) arena->purged_bytes += SLAB_SIZE;
+        }
+        released |= arena->purged_bytes != purged;
+        pthread_mutex_unlock(&arena->lock);
+    }
+    return released;
+}
+
+// Hint that [ptr, ptr + len) is about to be written: its pages are faulted
+// in now, in bulk. The range must lie within memory the program allocated.
+// Returns 0, or -1 with errno set.
+int malloc_populate(void *ptr, size_t len) {
+    if (!ptr || !len) return 0;
+    return populate_range(ptr, len);
+}
+
+// Faults in the pages covering [start, start + len) for writing. Kernels
+// before 5.14 reject MADV_POPULATE_WRITE, there each page is written to
+// with an atomic add of zero, which leaves the data as it is.
+static int populate_range(void *start, size_t len) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *first = (char*)((uintptr_t)start & ~(uintptr_t)(page - 1));
+    char *end = (char*)(((uintptr_t)start + len + page - 1) & ~(uintptr_t)(page - 1));
+    if (__atomic_load_n(&populate_advice_works, __ATOMIC_RELAXED)) {
+        if (madvise(first, (size_t)(end - first), MADV_POPULATE_WRITE) == 0) return 0;
+        if (errno != EINVAL) return -1;
+        __atomic_store_n(&populate_advice_works, 0, __ATOMIC_RELAXED);
+    }
+    for (char *p = first; p < end; p += page) {
+        __atomic_fetch_add(p, 0, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Commits and faults in size bytes of the main arena as one free block.
+// Decay and trimming leave these pages alone, see purge_range().
+static void pretouch_heap(size_t size) {
+    arena_t *arena = MAIN_ARENA;
+    size_t unit = release_unit();
+    size = BLOCK_DATA_SIZE(size);
+    lock_arena(arena);
+    void *data = request_space(arena, size);
+    if (data) {
+        populate_range(data, size);
+        arena->pinned_start = (char*)(((uintptr_t)data + unit - 1) & ~(uintptr_t)(unit - 1));
+        arena->pinned_end = (char*)(((uintptr_t)data + size + unit - 1) & ~(uintptr_t)(unit - 1));
+        insert_free_block(arena, GET_BLOCK_PTR(data));
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// The lower block of a coalesced pair stays ZEROED only if both were, in
+// which case the words between the two data portions are cleared
+static void merge_zeroed(metadata_t *lower, metadata_t *upper) {
+    if ((lower->word & upper->word & ZEROED) == 0) {
+        lower->word &= ~ZEROED;
+        return;
+    }
+    // Btag of lower, header and links of upper
+    memset((char*)upper - BTAG_SIZE, 0, BTAG_SIZE + METADATA_SIZE + sizeof(free_links_t));
+}
+
+// Unlinks the block from its class and decay list, neighbours' PREV_FREE bits are left to the caller.
+// ZEROED is kept, callers putting the block to use clear it.
+void remove_free_block(arena_t *arena, metadata_t *block) {
+    if (block->word & (DIRTY | MUZZY)) decay_unlink(arena, block);
+    free_links_t *links = LINKS(block);
+    block->word &= ~BLOCK_FREE;
+    if (links->prev) {
+        LINKS(links->prev)->next = links->next;
+    } else {
+        unsigned int cls = size_class(BLOCK_SIZE(block));
+        arena->free_lists[cls] = links->next;
+        if (!links->next) {
+            arena->nonempty_classes[cls / 64] &= ~(1ULL << (cls % 64));
+        }
+    }
+    
+    if (links->next) {
+        LINKS(links->next)->prev = links->prev;
+    }
+}
+
+metadata_t *get_next_block(metadata_t *block) {
+    return (metadata_t*)((char*)(block + 1) + BLOCK_SIZE(block));
+}
+
+// Only free previous blocks leave a btag behind, so this returns NULL for allocated ones
+metadata_t *get_prev_block(metadata_t *block) {
+    if (!(block->word & PREV_FREE)) {
+        return NULL;
+    }
+    uint64_t prev_size = *((uint64_t*)block - 1);
+    return (metadata_t*)((char*)block - prev_size - METADATA_SIZE);
+}
+
+static void *tcache_pop(unsigned int cls) {
+    void *ptr = tcache.bins[cls];
+    if (!ptr) return NULL;
+    tcache.bins[cls] = NEXT_OBJECT(ptr);
+    tcache.counts[cls]--;
+    return ptr;
+}
+
+// Keeps the object, still counted as used by its slab, in this thread's bin.
+// Objects of any arena may be cached. Returns 0 when the slab has to take it instead.
+static int tcache_push(void *ptr, unsigned int cls) {
+    if (tcache.disabled || tcache.counts[cls] >= TCACHE_BIN_LIMIT) return 0;
+
+    register_thread_exit();
+    NEXT_OBJECT(ptr) = tcache.bins[cls];
+    tcache.bins[cls] = ptr;
+    tcache.counts[cls]++;
+    return 1;
+}
+
+// Any non-NULL value makes the key destructor run when the thread exits
+static void register_thread_exit(void) {
+    if (!tcache.registered) {
+        pthread_once(&tcache_key_once, tcache_make_key);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
+    }
+}
+
+// Runs at thread exit, hands every cached object back to its slab
+static void tcache_flush(void *unused) {
+    (void)unused;
+    tcache.disabled = 1;
+#ifdef PERCPU_SUPPORTED
+    if (tcache.own_rseq) {
+        syscall(SYS_rseq, &own_rseq_area, sizeof(own_rseq_area), 1 /* RSEQ_FLAG_UNREGISTER */, RSEQ_SIG);
+        thread_rseq = RSEQ_UNAVAILABLE;
+    }
+#endif
+    for (unsigned int cls = 0; cls < SLAB_CLASSES; cls++) {
+        while (tcache.bins[cls]) {
+            void *ptr = tcache.bins[cls];
+            tcache.bins[cls] = NEXT_OBJECT(ptr);
+            release_object(ptr);
+        }
+        tcache.counts[cls] = 0;
+    }
+}
+
+static void tcache_make_key(void) {
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+// Slab object caches: the current CPU's bins in per-CPU mode, this thread's otherwise
+static void *cache_pop(unsigned int cls) {
+#ifdef PERCPU_SUPPORTED
+    rseq_area_t *rs;
+    if (percpu_caches && (rs = get_rseq())) return percpu_pop(rs, cls);
+#endif
+    return tcache_pop(cls);
+}
+
+static int cache_push(void *ptr, unsigned int cls) {
+#ifdef PERCPU_SUPPORTED
+    rseq_area_t *rs;
+    if (percpu_caches && (rs = get_rseq())) return percpu_push(rs, cls, ptr);
+#endif
+    return tcache_push(ptr, cls);
+}
+
+static void init_percpu(void) {
+#ifdef PERCPU_SUPPORTED
+    const char *env = getenv("ALLOC_PERCPU");
+    if (!env || atoi(env) <= 0) return;
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpus <= 0) return;
+    void *caches = mmap(NULL, cpus * sizeof(percpu_cache_t), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (caches == MAP_FAILED) return;
+    percpu_count = (unsigned int)cpus;
+    percpu_caches = caches;
+#endif
+}
+
+#ifdef PERCPU_SUPPORTED
+// This thread's rseq area: glibc's when it registered one, else our own.
+// NULL when neither works, the thread then keeps using its tcache.
+static rseq_area_t *get_rseq(void) {
+    rseq_area_t *rs = thread_rseq;
+    if (rs) return rs == RSEQ_UNAVAILABLE ? NULL : rs;
+
+    if (&__rseq_size && __rseq_size > 0) {
+        char *thread_pointer;
+        __asm__("movq %%fs:0, %0" : "=r"(thread_pointer));
+        rs = (rseq_area_t*)(thread_pointer + __rseq_offset);
+    } else if (syscall(SYS_rseq, &own_rseq_area, sizeof(own_rseq_area), 0, RSEQ_SIG) == 0) {
+        // The kernel keeps writing to the area, so it has to be unregistered before the thread is gone
+        rs = &own_rseq_area;
+        tcache.own_rseq = 1;
+        register_thread_exit();
+    } else {
+        rs = RSEQ_UNAVAILABLE;
+    }
+    thread_rseq = rs;
+    return rs == RSEQ_UNAVAILABLE ? NULL : rs;
+}
+
+// Both operations run as rseq critical sections between labels 1 and 2,
+// ending in a single committing store of the bin count. If the thread is
+// preempted, migrated or signalled before that store, the kernel moves it
+// to the abort handler at 4 and the bin is untouched, so no atomics are
+// needed. Descriptor 3 tells the kernel where the section is.
+static void *percpu_pop(rseq_area_t *rs, unsigned int cls) {
+    void *ptr = NULL;
+    percpu_bin_t *bins = &percpu_caches[0].bins[cls];
+    for (int attempt = 0; attempt < PERCPU_RETRIES; attempt++) {
+        __asm__ __volatile__ goto (
+            ".pushsection __rseq_cs, \"aw\"\n\t"
+            ".balign 32\n\t"
+            "3:\n\t"
+            ".long 0x0, 0x0\n\t"
+            ".quad 1f, (2f - 1f), 4f\n\t"
+            ".popsection\n\t"
+            "leaq 3b(%%rip), %%rax\n\t"
+            "movq %%rax, 8(%[rs])\n\t"
+            "1:\n\t"
+            "movl 4(%[rs]), %%eax\n\t"
+            "cmpl %[ncpu], %%eax\n\t"
+            "jae %l[unavailable]\n\t"
+            "imulq %[stride], %%rax\n\t"
+            "addq %[bins], %%rax\n\t"
+            "movq (%%rax), %%rcx\n\t"
+            "testq %%rcx, %%rcx\n\t"
+            "jz %l[unavailable]\n\t"
+            "movq (%%rax, %%rcx, 8), %%rdx\n\t"  // items[count - 1]
+            "movq %%rdx, (%[out])\n\t"
+            "decq %%rcx\n\t"
+            "movq %%rcx, (%%rax)\n\t"            // commit
+            "2:\n\t"
+            ".pushsection __rseq_failure, \"ax\"\n\t"
+            ".byte 0x0f, 0xb9, 0x3d\n\t"
+            ".long 0x53053053\n\t"
+            "4:\n\t"
+            "jmp %l[aborted]\n\t"
+            ".popsection\n\t"
+            :
+            : [rs] "r"(rs), [ncpu] "r"(percpu_count), [stride] "r"((uint64_t)sizeof(percpu_cache_t)),
+              [bins] "r"(bins), [out] "r"(&ptr)
+            : "rax", "rcx", "rdx", "memory", "cc"
+            : unavailable, aborted);
+        return ptr;
+    aborted:
+        continue;
+    }
+unavailable:
+    return NULL;
+}
+
+// Returns 0 when the bin is full, the object then goes back to its slab
+static int percpu_push(rseq_area_t *rs, unsigned int cls, void *ptr) {
+    percpu_bin_t *bins = &percpu_caches[0].bins[cls];
+    for (int attempt = 0; attempt < PERCPU_RETRIES; attempt++) {
+        __asm__ __volatile__ goto (
+            ".pushsection __rseq_cs, \"aw\"\n\t"
+            ".balign 32\n\t"
+            "3:\n\t"
+            ".long 0x0, 0x0\n\t"
+            ".quad 1f, (2f - 1f), 4f\n\t"
+            ".popsection\n\t"
+            "leaq 3b(%%rip), %%rax\n\t"
+            "movq %%rax, 8(%[rs])\n\t"
+            "1:\n\t"
+            "movl 4(%[rs]), %%eax\n\t"
+            "cmpl %[ncpu], %%eax\n\t"
+            "jae %l[full]\n\t"
+            "imulq %[stride], %%rax\n\t"
+            "addq %[bins], %%rax\n\t"
+            "movq (%%rax), %%rcx\n\t"
+            "cmpq %[limit], %%rcx\n\t"
+            "jae %l[full]\n\t"
+            "movq %[block], 8(%%rax, %%rcx, 8)\n\t"  // items[count]
+            "incq %%rcx\n\t"
+            "movq %%rcx, (%%rax)\n\t"               // commit
+            "2:\n\t"
+            ".pushsection __rseq_failure, \"ax\"\n\t"
+            ".byte 0x0f, 0xb9, 0x3d\n\t"
+            ".long 0x53053053\n\t"
+            "4:\n\t"
+            "jmp %l[aborted]\n\t"
+            ".popsection\n\t"
+            :
+            : [rs] "r"(rs), [ncpu] "r"(percpu_count), [stride] "r"((uint64_t)sizeof(percpu_cache_t)),
+              [bins] "r"(bins), [block] "r"(ptr), [limit] "i"(PERCPU_BIN_LIMIT)
+            : "rax", "rcx", "memory", "cc"
+            : full, aborted);
+        return 1;
+    aborted:
+        continue;
+    }
+full:
+    return 0;
+}
+#endif
+
+// Returns a block to the heap: directly when this thread owns its arena,
+// through that arena's remote free queue otherwise
+static void release_block(metadata_t *block) {
+    arena_t *arena = BLOCK_ARENA(block);
+    if (arena != get_thread_arena()) {
+        remote_free(arena, block);
+        return;
+    }
+    lock_arena(arena);
+    free_heap_block(arena, block);
+    int waiting = arena->dirty.head || arena->muzzy.head;
+    pthread_mutex_unlock(&arena->lock);
+    if (waiting && background_thread_wanted && !background_thread_started) start_background_thread();
+}
+
+static void release_object(void *ptr) {
+    arena_t *arena = &arenas[GET_SLAB(ptr)->arena];
+    if (arena != get_thread_arena()) {
+        remote_free_object(arena, ptr);
+        return;
+    }
+    lock_arena(arena);
+    slab_free(arena, ptr);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// Multi-producer push, the owner takes the whole stack at once so there is no ABA problem
+static void remote_free(arena_t *arena, metadata_t *block) {
+    metadata_t *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do {
+        LINKS(block)->next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, block, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Same for slab objects, linked through their first word
+static void remote_free_object(arena_t *arena, void *ptr) {
+    void *head = __atomic_load_n(&arena->remote_objects, __ATOMIC_RELAXED);
+    do {
+        NEXT_OBJECT(ptr) = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_objects, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Caller holds the arena lock
+static void drain_remote_frees(arena_t *arena) {
+    metadata_t *block = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (block) {
+        metadata_t *next = LINKS(block)->next;
+        free_heap_block(arena, block);
+        block = next;
+    }
+
+    void *ptr = __atomic_exchange_n(&arena->remote_objects, NULL, __ATOMIC_ACQUIRE);
+    while (ptr) {
+        void *next = NEXT_OBJECT(ptr);
+        slab_free(arena, ptr);
+        ptr = next;
+    }
+}
+
+// Whoever takes an arena's lock also applies the frees queued for it
+static void lock_arena(arena_t *arena) {
+    pthread_mutex_lock(&arena->lock);
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&arena->remote_objects, __ATOMIC_RELAXED)) {
+        drain_remote_frees(arena);
+    }
+}
+
+static void init_arenas(void) {
+    long count = 0;
+    const char *env = getenv("ALLOC_ARENAS");
+    if (env) count = atol(env);
+    if (count <= 0) count = ARENAS_PER_CPU * sysconf(_SC_NPROCESSORS_ONLN);
+    if (count <= 0) count = 1;
+    if (count > MAX_ARENAS) count = MAX_ARENAS;
+
+    env = getenv("ALLOC_MMAP_THRESHOLD");
+    if (env && atol(env) > 0) {
+        mmap_threshold = (size_t)atol(env);
+        mmap_threshold_fixed = 1;
+    }
+
+    env = getenv("ALLOC_TRIM_THRESHOLD");
+    if (env && atol(env) > 0) {
+        trim_threshold = (size_t)atol(env);
+        trim_threshold_fixed = 1;
+    }
+
+    env = getenv("ALLOC_DIRTY_DECAY_MS");
+    if (env) dirty_decay_ms = atol(env) < 0 ? -1 : atol(env);
+    env = getenv("ALLOC_MUZZY_DECAY_MS");
+    if (env) muzzy_decay_ms = atol(env) < 0 ? -1 : atol(env);
+    env = getenv("ALLOC_BACKGROUND_THREAD");
+    if (env) background_thread_wanted = atol(env) != 0;
+    env = getenv("ALLOC_LARGE_CACHE");
+    if (env) large_cache_budget = atol(env) < 0 ? 0 : (size_t)atol(env);
+    env = getenv("ALLOC_LARGE_CACHE_MS");
+    if (env) large_cache_ms = atol(env);
+    env = getenv("ALLOC_THP");
+    if (env) thp_enabled = atol(env) != 0;
+    env = getenv("ALLOC_POPULATE_THRESHOLD");
+    if (env && atol(env) > 0) populate_threshold = (size_t)atol(env);
+    env = getenv("ALLOC_PRETOUCH");
+    if (env && atol(env) > 0) pretouch_size = (size_t)atol(env);
+    env = getenv("ALLOC_STREAM_THRESHOLD");
+    if (env && atol(env) > 0) stream_threshold = (size_t)atol(env);
+    env = getenv("ALLOC_MREMAP");
+    if (env) mremap_enabled = atol(env) != 0;
+    env = getenv("ALLOC_CHECK_SIZED");
+    if (env) check_sized_frees = atol(env) != 0;
+    select_copy_kernel(getenv("ALLOC_COPY_KERNEL"));
+
+    for (unsigned int i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        arenas[i].index = i;
+    }
+    num_arenas = (unsigned int)count;
+    init_slabs();
+}
+
+// The first thread to allocate gets the main arena, later ones are dealt round robin
+static arena_t *get_thread_arena(void) {
+    if (!thread_arena) {
+        pthread_once(&arenas_once, init_arenas);
+        unsigned int n = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        thread_arena = &arenas[n % num_arenas];
+    }
+    return thread_arena;
+}
+
+static void alloc_init(void) {
+    pthread_once(&arenas_once, init_arenas);
+    init_percpu();
+    if (pretouch_size) pretouch_heap(pretouch_size);
+    // Keep the heap consistent in a child forked while another thread held a lock
+    pthread_atfork(fork_prepare, fork_release, fork_child);
+}
+
+static void fork_prepare(void) {
+    for (unsigned int i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&large_cache_lock);
+}
+
+static void fork_release(void) {
+    pthread_mutex_unlock(&large_cache_lock);
+    for (unsigned int i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+// Only the forking thread survives, the purging thread is started again when needed
+static void fork_child(void) {
+    fork_release();
+    background_thread_started = 0;
+}
@@ -10,6 +10,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
@@ -17,11 +18,20 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+extern char **environ;
+
 static int child_still_running = 1;
 static const char *CONTEST_TAG = "mcontest";
 
 static void *timeout_timer(void *ptr);
-static void print_stats(int result, alloc_stats_t *stats, double total_time);
+static int open_dtlb_counter(pid_t pid);
+static void print_stats(int result, alloc_stats_t *stats, double total_time,
+                        long long dtlb_misses);
 
 int main(int argc, char **argv) {
     /*
@@ -55,7 +65,16 @@ int main(int argc, char **argv) {
      * will replace the malloc(), calloc(), realloc(), and free() that is
      * defined by standard libc.
      */
-    char **env = malloc(3 * sizeof(char *));
+    /*
+     * Allocator tuning knobs (ALLOC_*) are passed through to the child, the
+     * rest of the environment is not.
+     */
+    int num_knobs = 0;
+    for (char **var = environ; *var; var++)
+        if (strncmp(*var, "ALLOC_", 6) == 0)
+            num_knobs++;
+
+    char **env = malloc((3 + num_knobs) * sizeof(char *));
     env[0] = malloc(1024 * sizeof(char));
 #ifdef CONTEST_MODE
     sprintf(env[0], "LD_PRELOAD=./contest-alloc.so");
@@ -71,6 +90,13 @@ int main(int argc, char **argv) {
     sprintf(env[1], "ALLOC_CONTEST_MMAP=%s", file_name);
 #endif
 
+    int num_env = env[1] ? 2 : 1;
+    for (char **var = environ; *var; var++)
+        if (strncmp(*var, "ALLOC_", 6) == 0 &&
+            strncmp(*var, "ALLOC_CONTEST_MMAP=", 19) != 0)
+            env[num_env++] = strdup(*var);
+    env[num_env] = NULL;
+
     /*
      * Replace the current running process with the process specified by the
      * command
@@ -79,19 +105,36 @@ int main(int argc, char **argv) {
      * nothing we could really do; however, we do our best to provide useful
      * output
      * with a call to perror().
+     *
+     * The child waits on a pipe until its dTLB miss counter is set up, the
+     * counter itself only starts at exec().
      */
+    int go[2];
+    if (pipe(go) == -1) {
+        perror("pipe()");
+        return 2;
+    }
     int forkid = fork();
     if (forkid == 0) /* child */
     {
+        char c;
+        close(go[1]);
+        read(go[0], &c, 1);
+        close(go[0]);
         execve(argv[1], argv + 1,
                env); /* Note that exec() will not return on success. */
         perror("exec() failed");
         return 3;
     }
-    free(env[1]);
-    free(env[0]);
+    for (char **var = env; *var; var++)
+        free(*var);
     free(env);
 
+    int dtlb_fd = open_dtlb_counter(forkid);
+    close(go[0]);
+    write(go[1], "", 1);
+    close(go[1]);
+
     pthread_t tid;
     pthread_create(&tid, NULL, timeout_timer, &forkid);
     child_still_running = 1;
@@ -105,6 +148,14 @@ int main(int argc, char **argv) {
     child_still_running = 0;
     pthread_detach(tid);
 
+    long long dtlb_misses = -1;
+    if (dtlb_fd != -1) {
+        if (read(dtlb_fd, &dtlb_misses, sizeof(dtlb_misses)) !=
+            sizeof(dtlb_misses))
+            dtlb_misses = -1;
+        close(dtlb_fd);
+    }
+
     FILE *file = fopen(file_name, "r");
     alloc_stats_t *stats = mmap(NULL, sizeof(alloc_stats_t), PROT_READ,
                                 MAP_SHARED, fileno(file), 0);
@@ -126,7 +177,7 @@ int main(int argc, char **argv) {
     double total_time =
         total_sec + ((double)total_usec / ((double)1000 * 1000));
 
-    print_stats(result, stats, total_time);
+    print_stats(result, stats, total_time, dtlb_misses);
 
     munmap(stats, sizeof(alloc_stats_t));
     unlink(file_name);
@@ -150,7 +201,35 @@ static void *timeout_timer(void *ptr) {
     return NULL;
 }
 
-static void print_stats(int status, alloc_stats_t *stats, double total_time) {
+/*
+ * Counts the dTLB load misses of the child and every thread or process it
+ * starts, in user space, from its exec() on.  Returns -1 where hardware
+ * counters are not available, e.g. in most VMs or with a strict
+ * perf_event_paranoid setting.
+ */
+static int open_dtlb_counter(pid_t pid) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+static void print_stats(int status, alloc_stats_t *stats, double total_time,
+                        long long dtlb_misses) {
     int result = WEXITSTATUS(status);
     int abnormal_exit = WIFSIGNALED(status);
     int signum = WTERMSIG(status);
@@ -171,4 +250,9 @@ static void print_stats(int status, alloc_stats_t *stats, double total_time) {
                (stats->memory_heap_sum / (double)stats->memory_uses));
 
     printf("[%s]: TIME: %f\n", CONTEST_TAG, total_time);
+
+    if (dtlb_misses < 0)
+        printf("[%s]: DTLB_MISSES: n/a\n", CONTEST_TAG);
+    else
+        printf("[%s]: DTLB_MISSES: %lld\n", CONTEST_TAG, dtlb_misses);
 }
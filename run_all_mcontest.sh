@@ -12,13 +12,13 @@
 #  this will skip test-1 through test-5
 
 # What test cases do you want?
-test_array=(1 2 3 4 5 6 7 8 9 10 11 12 13)
+test_array=(1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17)
 # What do you want to skip?
 skip_arr=()
 
 # Functions 
 usage () { 
-  echo "Usage: ./run_all_mcontest.sh [-s <1-13>]" 1>&2; exit 1; 
+  echo "Usage: ./run_all_mcontest.sh [-s <1-17>]" 1>&2; exit 1; 
 }
 
 array_contains () {
@@ -47,7 +47,7 @@ do
     then
       continue
     else
-      if [ $var -gt 13 ] || [ $var -lt 1 ]
+      if [ $var -gt 17 ] || [ $var -lt 1 ]
       then
         usage
       else
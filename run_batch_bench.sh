@@ -0,0 +1,16 @@
+#!/bin/bash
+
+# Runs testers/bench-batch.c, which compares malloc_batch()/free_batch() with
+# as many malloc()/free() calls for a few block sizes, once per batch size.
+#
+#   ./run_batch_bench.sh [batch sizes...]
+
+batches=${*:-32 128 256}
+bench=testers_exe/bench-batch
+
+make alloc.so $bench > /dev/null || exit 1
+
+for n in $batches; do
+    LD_PRELOAD="$PWD/alloc.so" ./$bench "$n"
+    echo
+done
@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# Runs testers with each copy kernel: libc's memmove/memset, and the AVX2 and
+# AVX-512 streaming kernels (ALLOC_COPY_KERNEL). Large blocks are moved by
+# copying instead of mremap (ALLOC_MREMAP=0), so realloc exercises the kernels.
+#
+#   ./run_copy_bench.sh [tester numbers...]
+#
+# A kernel the CPU lacks falls back to the widest one it has.
+
+testers=${*:-6 7 8}
+
+make alloc.so mreplace $(printf 'testers_exe/tester-%s ' $testers) > /dev/null || exit 1
+
+for i in $testers; do
+    for kernel in libc avx2 avx512; do
+        echo "== tester-$i, ALLOC_COPY_KERNEL=$kernel =="
+        ALLOC_MREMAP=0 ALLOC_COPY_KERNEL=$kernel ./mreplace testers_exe/tester-$i | grep -E 'STATUS|TIME'
+    done
+    echo
+done
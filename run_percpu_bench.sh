@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# Runs testers/bench-percpu.c with per-thread caches and with per-CPU caches
+# (ALLOC_PERCPU=1) and prints the throughput and idle footprint of both.
+#
+#   ./run_percpu_bench.sh [threads]
+#
+# Per-CPU mode needs Linux on x86-64, elsewhere both runs use thread caches.
+
+threads=${1:-1024}
+bench=testers_exe/bench-percpu
+
+make alloc.so $bench > /dev/null || exit 1
+
+for mode in 0 1; do
+    if [ "$mode" == "1" ]; then
+        echo "== per-CPU caches =="
+    else
+        echo "== per-thread caches =="
+    fi
+    ALLOC_PERCPU=$mode LD_PRELOAD="$PWD/alloc.so" ./$bench "$threads"
+    echo
+done
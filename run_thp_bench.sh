@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Runs testers with regular pages and with transparent huge pages
+# (ALLOC_THP=1) and prints the time and dTLB load misses mreplace reports.
+#
+#   ./run_thp_bench.sh [tester numbers...]
+#
+# dTLB misses show as n/a where the kernel gives no access to hardware counters.
+
+testers=${*:-2 5 9}
+
+make alloc.so mreplace $(printf 'testers_exe/tester-%s ' $testers) > /dev/null || exit 1
+
+for i in $testers; do
+    for mode in 0 1; do
+        echo "== tester-$i, ALLOC_THP=$mode =="
+        ALLOC_THP=$mode ./mreplace testers_exe/tester-$i | grep -E 'STATUS|TIME|DTLB'
+    done
+    echo
+done
@@ -0,0 +1,75 @@
+/**
+ * malloc
+ * CS 341 - Spring 2025
+ */
+#include "tester-utils.h"
+#include <time.h>
+
+// Compares malloc_batch()/free_batch() against as many malloc()/free() calls,
+// see run_batch_bench.sh. Prints millions of blocks allocated and freed per second.
+#define DEFAULT_BATCH 128
+#define DEFAULT_ROUNDS 20000
+
+// Only the preloaded allocator has these, weak so the bench links without it
+size_t malloc_batch(size_t size, size_t n, void **ptrs) __attribute__((weak));
+void free_batch(size_t n, void **ptrs) __attribute__((weak));
+
+static const size_t sizes[] = {32, 128, 512, 1 * K, 4 * K};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run_single(size_t size, size_t n, long rounds, void **ptrs) {
+    double start = now();
+    for (long round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < n; i++) {
+            ptrs[i] = malloc(size);
+            *(volatile char *)ptrs[i] = 1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            free(ptrs[i]);
+        }
+    }
+    return n * rounds / (now() - start) / 1e6;
+}
+
+static double run_batch(size_t size, size_t n, long rounds, void **ptrs) {
+    double start = now();
+    for (long round = 0; round < rounds; round++) {
+        if (malloc_batch(size, n, ptrs) != n) {
+            fprintf(stderr, "Memory failed to allocate!\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < n; i++) {
+            *(volatile char *)ptrs[i] = 1;
+        }
+        free_batch(n, ptrs);
+    }
+    return n * rounds / (now() - start) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    if (!malloc_batch || !free_batch) {
+        fprintf(stderr, "malloc_batch() and free_batch() not found, preload alloc.so\n");
+        return 1;
+    }
+
+    long batch = argc > 1 ? atol(argv[1]) : DEFAULT_BATCH;
+    long rounds = argc > 2 ? atol(argv[2]) : DEFAULT_ROUNDS;
+    if (batch <= 0) batch = DEFAULT_BATCH;
+    if (rounds <= 0) rounds = DEFAULT_ROUNDS;
+    void **ptrs = malloc(batch * sizeof(void *));
+
+    printf("%8s %8s %14s %14s\n", "size", "batch", "single Mops/s", "batch Mops/s");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double single = run_single(sizes[i], batch, rounds, ptrs);
+        double batched = run_batch(sizes[i], batch, rounds, ptrs);
+        printf("%8zu %8ld %14.1f %14.1f\n", sizes[i], batch, single, batched);
+    }
+
+    free(ptrs);
+    return 0;
+}
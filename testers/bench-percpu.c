@@ -0,0 +1,94 @@
+/**
+ * malloc
+ * CS 341 - Spring 2025
+ */
+#include "tester-utils.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compares ALLOC_PERCPU=1 against the default per-thread caches, see run_percpu_bench.sh.
+// Every thread fills the small block caches, then idles while the RSS is sampled.
+#define DEFAULT_THREADS 1024
+#define ROUNDS 200
+#define BATCH 64
+#define MIN_ALLOC_SIZE 16
+#define MAX_ALLOC_SIZE 512
+#define THREAD_STACK_SIZE (64 * K)
+
+static pthread_barrier_t warmed_up;
+static pthread_barrier_t sampled;
+
+static void *worker(void *arg) {
+    unsigned int seed = (unsigned int)(long)arg;
+    char *blocks[BATCH];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < BATCH; i++) {
+            int size = (rand_r(&seed) % (MAX_ALLOC_SIZE - MIN_ALLOC_SIZE + 1)) + MIN_ALLOC_SIZE;
+            blocks[i] = malloc(size);
+            blocks[i][0] = (char)size;
+        }
+        for (int i = 0; i < BATCH; i++) {
+            free(blocks[i]);
+        }
+    }
+
+    // Stay alive, caches full, until the main thread has measured the footprint
+    pthread_barrier_wait(&warmed_up);
+    pthread_barrier_wait(&sampled);
+    return NULL;
+}
+
+static long resident_kb(void) {
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) return -1;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = -1;
+    fclose(statm);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / K);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+    if (num_threads <= 0) num_threads = DEFAULT_THREADS;
+
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    pthread_barrier_init(&warmed_up, NULL, num_threads + 1);
+    pthread_barrier_init(&sampled, NULL, num_threads + 1);
+
+    long baseline = resident_kb();
+    double start = now();
+    for (long i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], &attr, worker, (void *)i)) {
+            fprintf(stderr, "Could not create thread %ld\n", i);
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&warmed_up);
+    double elapsed = now() - start;
+    long resident = resident_kb();
+    pthread_barrier_wait(&sampled);
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    double ops = 2.0 * num_threads * ROUNDS * BATCH;
+    printf("threads: %d\n", num_threads);
+    printf("throughput: %.2f Mops/s\n", ops / elapsed / 1e6);
+    printf("idle rss: %ld KiB (%ld KiB over baseline)\n", resident, resident - baseline);
+
+    pthread_attr_destroy(&attr);
+    free(threads);
+    return 0;
+}
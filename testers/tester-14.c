@@ -0,0 +1,104 @@
+/**
+ * malloc
+ * CS 341 - Spring 2025
+ */
+#include "tester-utils.h"
+#include <pthread.h>
+
+#define NUM_THREADS 8
+#define ALLOCS_PER_THREAD 200000
+#define MIN_ALLOC_SIZE 8
+#define MAX_ALLOC_SIZE 2 * K
+#define HANDOFF_SLOTS 64
+
+// Blocks handed to the next thread, which frees them (cross-thread free)
+typedef struct handoff {
+    pthread_mutex_t lock;
+    char *blocks[HANDOFF_SLOTS];
+    int sizes[HANDOFF_SLOTS];
+} handoff_t;
+
+static handoff_t handoffs[NUM_THREADS];
+static int failed;
+
+static int check_block(char *ptr, int size) {
+    char c = (char)size;
+    if (ptr[0] != c || ptr[size / 2] != c || ptr[size - 1] != c) {
+        fprintf(stderr, "Memory failed to contain correct data across threads!\n");
+        return 0;
+    }
+    return 1;
+}
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+    unsigned int seed = (unsigned int)(rand_today() + id);
+    handoff_t *next = &handoffs[(id + 1) % NUM_THREADS];
+
+    for (int i = 0; i < ALLOCS_PER_THREAD && !failed; i++) {
+        int size = (rand_r(&seed) % (MAX_ALLOC_SIZE - MIN_ALLOC_SIZE + 1)) + MIN_ALLOC_SIZE;
+        char *ptr = malloc(size);
+        if (ptr == NULL) {
+            fprintf(stderr, "Memory failed to allocate!\n");
+            failed = 1;
+            break;
+        }
+        memset(ptr, (char)size, size);
+
+        // Swap it into the next thread's slot and free whatever was there
+        int slot = rand_r(&seed) % HANDOFF_SLOTS;
+        pthread_mutex_lock(&next->lock);
+        char *old = next->blocks[slot];
+        int old_size = next->sizes[slot];
+        next->blocks[slot] = ptr;
+        next->sizes[slot] = size;
+        pthread_mutex_unlock(&next->lock);
+
+        if (old) {
+            if (!check_block(old, old_size))
+                failed = 1;
+            free(old);
+        }
+
+        // Also churn some memory that never leaves this thread
+        char *local = malloc(size / 2 + 1);
+        if (local == NULL) {
+            failed = 1;
+            break;
+        }
+        free(local);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    malloc(1);
+
+    pthread_t threads[NUM_THREADS];
+    for (long i = 0; i < NUM_THREADS; i++) {
+        pthread_mutex_init(&handoffs[i].lock, NULL);
+    }
+    for (long i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        for (int j = 0; j < HANDOFF_SLOTS; j++) {
+            if (handoffs[i].blocks[j]) {
+                if (!check_block(handoffs[i].blocks[j], handoffs[i].sizes[j]))
+                    return 1;
+                free(handoffs[i].blocks[j]);
+            }
+        }
+    }
+
+    if (failed)
+        return 1;
+
+    fprintf(stderr, "Memory was allocated and freed across threads!\n");
+    return 0;
+}
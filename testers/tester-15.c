@@ -0,0 +1,55 @@
+/**
+ * malloc
+ * CS 341 - Spring 2025
+ */
+#include "tester-utils.h"
+#include <unistd.h>
+
+#define NUM_BLOCKS 8
+#define BLOCK_SIZE (100 * M)
+#define IDLE_SECONDS 2
+#define NUM_CYCLES 10000
+#define SMALL_SIZE (2 * K)
+#define MAX_RESIDENT (64 * M)
+
+static long resident_bytes(void) {
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) return -1;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = -1;
+    fclose(statm);
+    return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        char *ptr = malloc(BLOCK_SIZE);
+        if (ptr == NULL) {
+            fprintf(stderr, "Memory failed to allocate!\n");
+            return 1;
+        }
+        memset(ptr, 'a', BLOCK_SIZE);
+        free(ptr);
+    }
+
+    // Freed large blocks may be kept for a while, but not for good
+    sleep(IDLE_SECONDS);
+    for (int i = 0; i < NUM_CYCLES; i++) {
+        char *ptr = malloc(SMALL_SIZE);
+        if (ptr == NULL) {
+            fprintf(stderr, "Memory failed to allocate!\n");
+            return 1;
+        }
+        ptr[0] = 'b';
+        free(ptr);
+    }
+
+    long resident = resident_bytes();
+    if (resident < 0 || resident > MAX_RESIDENT) {
+        fprintf(stderr, "Freed memory was not given back: %ld bytes resident!\n", resident);
+        return 1;
+    }
+
+    fprintf(stderr, "Freed memory was given back after it idled!\n");
+    return 0;
+}
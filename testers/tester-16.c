@@ -0,0 +1,77 @@
+/**
+ * malloc
+ * CS 341 - Spring 2025
+ */
+#include "tester-utils.h"
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define MIN_ALIGNMENT 16
+#define MAX_ALIGNMENT (1 * M)
+#define NUM_SIZES 6
+#define NUM_ROUNDS 4
+
+static const size_t sizes[NUM_SIZES] = {8, 100, 500, 5 * K, 200 * K, 3 * M};
+
+// Checks the block's alignment and contents, grows it with realloc() and frees it
+static void check_block(const char *name, void *ptr, size_t alignment, size_t size, int c) {
+    if (ptr == NULL) {
+        fprintf(stderr, "%s(%zu, %zu) failed to allocate!\n", name, alignment, size);
+        exit(1);
+    }
+    if ((uintptr_t)ptr & (alignment - 1)) {
+        fprintf(stderr, "%s(%zu, %zu) returned %p, which is misaligned!\n", name, alignment, size, ptr);
+        exit(2);
+    }
+
+    memset(ptr, c, size);
+    verify_write(ptr, size);
+    char *grown = realloc(ptr, 2 * size);
+    if (grown == NULL) {
+        fprintf(stderr, "Memory failed to reallocate!\n");
+        exit(1);
+    }
+    if (!verify_read(grown, size)) exit(3);
+    verify(grown + 1, c, size - 2);
+    free(grown);
+}
+
+int main(int argc, char *argv[]) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    for (int round = 0; round < NUM_ROUNDS; round++) {
+        for (size_t alignment = MIN_ALIGNMENT; alignment <= MAX_ALIGNMENT; alignment *= 4) {
+            for (int i = 0; i < NUM_SIZES; i++) {
+                size_t size = sizes[i];
+                int c = 'a' + (round * NUM_SIZES + i) % 26;
+
+                void *ptr = NULL;
+                if (posix_memalign(&ptr, alignment, size) != 0) ptr = NULL;
+                check_block("posix_memalign", ptr, alignment, size, c);
+
+                // aligned_alloc() wants the size to be a multiple of the alignment
+                size_t multiple = (size + alignment - 1) & ~(alignment - 1);
+                check_block("aligned_alloc", aligned_alloc(alignment, multiple), alignment, multiple, c);
+                check_block("memalign", memalign(alignment, size), alignment, size, c);
+            }
+        }
+
+        for (int i = 0; i < NUM_SIZES; i++) {
+            check_block("valloc", valloc(sizes[i]), page, sizes[i], 'v');
+            // pvalloc() hands out whole pages, all of which are usable
+            size_t pages = (sizes[i] + page - 1) & ~(page - 1);
+            check_block("pvalloc", pvalloc(sizes[i]), page, pages, 'p');
+        }
+    }
+
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, 24, 100) != EINVAL) {
+        fprintf(stderr, "posix_memalign() accepted an alignment that is not a power of two!\n");
+        return 4;
+    }
+
+    fprintf(stderr, "Aligned memory was allocated, used, and freed!\n");
+    return 0;
+}
@@ -0,0 +1,125 @@
+/**
+ * malloc
+ * CS 341 - Spring 2025
+ */
+#include "tester-utils.h"
+#include <stdint.h>
+
+#define CHUNK_SIZE (4 * K)
+#define NUM_BLOCKS 256
+#define BLOCK_SIZE 100
+#define LARGE_SIZE (3 * CHUNK_SIZE)
+#define NUM_ROUNDS 1000
+
+// Regions are this allocator's own, other ones leave these NULL
+typedef struct region region_t;
+region_t *arena_create(size_t chunk_size) __attribute__((weak));
+void *arena_alloc(region_t *region, size_t size) __attribute__((weak));
+void *arena_mark(region_t *region) __attribute__((weak));
+void arena_release_to_mark(region_t *region, void *mark) __attribute__((weak));
+void arena_reset(region_t *region) __attribute__((weak));
+void arena_destroy(region_t *region) __attribute__((weak));
+region_t *arena_scope(region_t *region) __attribute__((weak));
+
+static void *checked_alloc(region_t *region, size_t size) {
+    void *ptr = arena_alloc(region, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory failed to allocate!\n");
+        exit(1);
+    }
+    if ((uintptr_t)ptr & 15) {
+        fprintf(stderr, "arena_alloc() returned %p, which is misaligned!\n", ptr);
+        exit(2);
+    }
+    return ptr;
+}
+
+static void fail(const char *message) {
+    fprintf(stderr, "%s\n", message);
+    exit(3);
+}
+
+int main(int argc, char *argv[]) {
+    if (!arena_create) {
+        fprintf(stderr, "No regions to test, nothing to do!\n");
+        return 0;
+    }
+
+    region_t *region = arena_create(CHUNK_SIZE);
+    if (region == NULL) fail("Region failed to be created!");
+
+    // Fill a few chunks, everything stays put
+    char *blocks[NUM_BLOCKS];
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        blocks[i] = checked_alloc(region, BLOCK_SIZE);
+        memset(blocks[i], i, BLOCK_SIZE);
+    }
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        verify(blocks[i], i, BLOCK_SIZE);
+    }
+
+    // Releasing to a mark frees what came after it, whatever the chunks
+    for (int round = 0; round < NUM_ROUNDS; round++) {
+        void *mark = arena_mark(region);
+        for (int i = 0; i < NUM_BLOCKS / 8; i++) {
+            memset(checked_alloc(region, BLOCK_SIZE), 'x', BLOCK_SIZE);
+        }
+        memset(checked_alloc(region, LARGE_SIZE), 'y', LARGE_SIZE);
+        arena_release_to_mark(region, mark);
+        if (checked_alloc(region, BLOCK_SIZE) != mark) fail("Released memory was not handed out again!");
+        arena_release_to_mark(region, mark);
+    }
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        verify(blocks[i], i, BLOCK_SIZE);
+    }
+
+    // A reset region starts over at its first block
+    for (int round = 0; round < NUM_ROUNDS; round++) {
+        arena_reset(region);
+        char *first = checked_alloc(region, BLOCK_SIZE);
+        if (first != blocks[0]) fail("Reset region did not start over!");
+        memset(first, 'z', BLOCK_SIZE);
+        for (int i = 1; i < NUM_BLOCKS; i++) {
+            checked_alloc(region, BLOCK_SIZE);
+        }
+    }
+
+    // In scope, malloc() and calloc() take from the region and free() leaves
+    // the blocks alone. Scopes nest.
+    arena_reset(region);
+    region_t *inner = arena_create(0);
+    if (inner == NULL) fail("Region failed to be created!");
+    if (arena_scope(region) != NULL) fail("No region should have been in scope!");
+    char *mark = arena_mark(region);
+    char *ptr = malloc(BLOCK_SIZE);
+    if (ptr == NULL) fail("Memory failed to allocate!");
+    if (ptr <= mark || ptr >= mark + CHUNK_SIZE) fail("malloc() did not use the region in scope!");
+    memset(ptr, 'a', BLOCK_SIZE);
+    verify_write(ptr, BLOCK_SIZE);
+    char *dropped = malloc(BLOCK_SIZE);
+    if (dropped == NULL) fail("Memory failed to allocate!");
+    uintptr_t dropped_at = (uintptr_t)dropped;
+    free(dropped);
+    char *zeroed = calloc(BLOCK_SIZE, 1);
+    if (zeroed == NULL) fail("Memory failed to allocate!");
+    if ((uintptr_t)zeroed <= dropped_at || zeroed >= mark + CHUNK_SIZE) fail("calloc() did not use the region in scope!");
+    verify(zeroed, 0, BLOCK_SIZE);
+
+    if (arena_scope(inner) != region) fail("The outer region should have been in scope!");
+    if (arena_scope(region) != inner) fail("The inner region should have been in scope!");
+    if (arena_scope(NULL) != region) fail("The outer region should have been in scope!");
+
+    // Out of scope, its blocks still grow with realloc()
+    if (!verify_read(ptr, BLOCK_SIZE)) exit(4);
+    char *grown = realloc(ptr, 10 * BLOCK_SIZE);
+    if (grown == NULL) fail("Memory failed to reallocate!");
+    if (!verify_read(grown, BLOCK_SIZE)) exit(4);
+    verify(grown + 1, 'a', BLOCK_SIZE - 2);
+    free(grown);
+
+    arena_destroy(inner);
+    arena_destroy(region);
+
+    fprintf(stderr, "Regions were allocated from, released, and reset!\n");
+    return 0;
+}